@@ -11,6 +11,8 @@
 #include <string.h>
 #include <errno.h>
 
+extern time_t startupTime;
+
 /* devfsOpendir(): handler for opendir() on the /dev file system
  * params: req - request message buffer
  * params: res - response message buffer
@@ -130,4 +132,96 @@ void devfsReaddir(SyscallHeader *req, SyscallHeader *res) {
     response->header.header.status = 0;
     response->end = 1;
     luxSendKernel(res);
-}
\ No newline at end of file
+}
+/* devfsGetdents(): handler for getdents() on the /dev file system
+ * params: req - request message buffer
+ * params: res - response message buffer
+ * returns: nothing, response relayed to virtual file system
+ */
+
+void devfsGetdents(SyscallHeader *req, SyscallHeader *res) {
+    GetdentsCommand *cmd = (GetdentsCommand *) req;
+    memcpy(res, req, sizeof(GetdentsCommand));
+
+    GetdentsCommand *response = (GetdentsCommand *) res;
+    response->header.header.response = 1;
+    response->header.header.length = sizeof(GetdentsCommand);
+    response->header.header.status = 0;
+    response->length = 0;
+    response->count = 0;
+    response->end = 0;
+
+    // the response buffer is of fixed size
+    size_t capacity = cmd->length;
+    if(capacity > (SERVER_MAX_SIZE - sizeof(GetdentsCommand)))
+        capacity = SERVER_MAX_SIZE - sizeof(GetdentsCommand);
+
+    int depth = countPath(cmd->path);
+    int parentLength = strlen(cmd->path);
+    size_t position = cmd->position;
+    size_t counter = 2;     // positions 0 and 1 are self and parent
+    int i = 0;
+
+    for(;;) {
+        const char *name = NULL;
+        DeviceFile *dev = NULL;
+
+        if(position == 0) {
+            name = ".";
+        } else if(position == 1) {
+            name = "..";
+        } else {
+            // skip over devices that are not in this directory and ones that
+            // were already returned
+            for(; i < deviceCount; i++) {
+                if((!memcmp(devices[i].name, cmd->path, parentLength)) && (countPath(devices[i].name) == (depth+1))) {
+                    counter++;
+                    if(counter > position) {
+                        dev = &devices[i];
+                        if(parentLength > 1) name = &devices[i].name[parentLength+1];
+                        else name = &devices[i].name[1];
+                        i++;
+                        break;
+                    }
+                }
+            }
+
+            if(!name) {
+                response->end = 1;  // reached end of directory
+                break;
+            }
+        }
+
+        size_t recordSize = (sizeof(DirentRecord) + strlen(name) + 1 + 7) & ~7;
+        if((response->length + recordSize) > capacity) {
+            // at least one record must fit
+            if(!response->count) response->header.header.status = -EINVAL;
+            break;
+        }
+
+        DirentRecord *record = (DirentRecord *)((uintptr_t)response->data + response->length);
+        memset(record, 0, recordSize);
+        record->length = recordSize;
+        record->position = ++position;
+        strcpy(record->name, name);
+
+        if(cmd->flags & GETDENTS_STAT) {
+            record->flags = GETDENTS_STAT;
+            if(dev) {
+                memcpy(&record->status, &dev->status, sizeof(struct stat));
+            } else {
+                record->status.st_mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+                record->status.st_ctime = startupTime;
+                record->status.st_mtime = startupTime;
+                record->status.st_atime = startupTime;
+            }
+        }
+
+        response->length += recordSize;
+        response->count++;
+    }
+
+    response->position = position;
+    response->header.header.length += response->length;
+    luxSendKernel(res);
+}
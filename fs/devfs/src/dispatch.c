@@ -19,6 +19,7 @@ void devfsIoctl(SyscallHeader *, SyscallHeader *);
 void devfsOpendir(SyscallHeader *, SyscallHeader *);
 void devfsReaddir(SyscallHeader *, SyscallHeader *);
 void devfsMmap(SyscallHeader *, SyscallHeader *);
+void devfsGetdents(SyscallHeader *, SyscallHeader *);
 
 void (*dispatchTable[])(SyscallHeader *, SyscallHeader *) = {
     devfsStat,          // 0 - stat()
@@ -44,4 +45,8 @@ void (*dispatchTable[])(SyscallHeader *, SyscallHeader *) = {
     NULL,               // 20 - unlink()
     NULL,               // 21 - symlink()
     NULL,               // 22 - readlink()
+    NULL,               // 23 - statvfs()
+    devfsGetdents,      // 24 - getdents()
+    NULL,               // 25 - fallocate()
+    NULL,               // 26 - copy_file_range()
 };
\ No newline at end of file
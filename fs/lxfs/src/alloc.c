@@ -0,0 +1,413 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The free space of a volume is tracked in memory by a bitmap with one bit
+ * per block, set when the block is free. A second level summary bitmap has
+ * one bit per 64-bit word of the free map, set when that word has any free
+ * block, so that searches can skip 4096 allocated blocks at a time. Both are
+ * built from the block table at mount time and kept in sync by
+ * lxfsSetNextBlock(), which is the only place the block table is modified.
+ * The number of chains on the volume is counted the same way for statvfs(),
+ * as is the number of links between non-adjacent blocks for measuring
+ * fragmentation.
+ *
+ * Allocation is goal-directed: a file is extended in place after its last
+ * block where possible, and otherwise placed in the nearest free run that is
+ * large enough. A few blocks past the end of a file that is being appended
+ * to are reserved for it by clearing them from the free map, so that other
+ * files allocating at the same time don't interleave with it.
+ */
+
+/* lxfsBitmapInit(): builds the free space bitmap from the block table
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsBitmapInit(Mountpoint *mp) {
+    uint64_t words = (mp->volumeSize + 63) / 64;
+    mp->freeMap = calloc(words, sizeof(uint64_t));
+    mp->freeSummary = calloc((words + 63) / 64, sizeof(uint64_t));
+    if(!mp->freeMap || !mp->freeSummary) {
+        free(mp->freeMap);
+        free(mp->freeSummary);
+        return 1;
+    }
+
+    mp->freeBlocks = 0;
+    mp->fileCount = 0;
+    mp->fragments = 0;
+
+    // read the block table directly rather than through the cache so that
+    // mounting a large volume doesn't start off by thrashing the cache
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t tableSize = (mp->volumeSize + entries - 1) / entries;
+    uint64_t *data = (uint64_t *) mp->blockTableBuffer;
+
+    for(uint64_t i = 0; i < tableSize; i++) {
+        lseek(mp->fd, (i + 33) * mp->blockSizeBytes, SEEK_SET);
+        if(read(mp->fd, data, mp->blockSizeBytes) != mp->blockSizeBytes) {
+            free(mp->freeMap);
+            free(mp->freeSummary);
+            return 1;
+        }
+
+        for(uint64_t j = 0; j < entries; j++) {
+            uint64_t block = (i * entries) + j;
+            if(block >= mp->volumeSize) break;
+            if(data[j] == LXFS_BLOCK_FREE) lxfsMarkBlock(mp, block, 1);
+            else if(data[j] == LXFS_BLOCK_EOF) mp->fileCount++;
+            else if(LXFS_FRAGMENTED(block, data[j])) mp->fragments++;
+        }
+    }
+
+    return 0;
+}
+
+/* lxfsMarkBlock(): updates the free space bitmap for a single block
+ * params: mp - mountpoint
+ * params: block - block number
+ * params: free - non-zero if the block is now free
+ * returns: nothing
+ */
+
+void lxfsMarkBlock(Mountpoint *mp, uint64_t block, int free) {
+    if(!mp->freeMap || (block >= mp->volumeSize)) return;
+
+    uint64_t word = block / 64;
+    uint64_t bit = 1ULL << (block % 64);
+    if(free && !(mp->freeMap[word] & bit)) {
+        mp->freeMap[word] |= bit;
+        mp->freeSummary[word / 64] |= (1ULL << (word % 64));
+        mp->freeBlocks++;
+    } else if(!free && (mp->freeMap[word] & bit)) {
+        mp->freeMap[word] &= ~bit;
+        if(!mp->freeMap[word]) mp->freeSummary[word / 64] &= ~(1ULL << (word % 64));
+        mp->freeBlocks--;
+    }
+}
+
+/* lxfsIsFree(): checks the free space bitmap for a single block
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: non-zero if the block is free
+ */
+
+int lxfsIsFree(Mountpoint *mp, uint64_t block) {
+    if(block < 33 || block >= mp->volumeSize) return 0;
+    return (mp->freeMap[block / 64] >> (block % 64)) & 1;
+}
+
+/* lxfsNextFree(): finds the first free block at or after a given block
+ * params: mp - mountpoint
+ * params: start - block number to start searching at
+ * returns: block number, zero if there is no free block after start
+ */
+
+uint64_t lxfsNextFree(Mountpoint *mp, uint64_t start) {
+    if(start < 33) start = 33;  // the first 33 blocks are reserved
+    if(start >= mp->volumeSize) return 0;
+
+    uint64_t words = (mp->volumeSize + 63) / 64;
+    uint64_t word = start / 64;
+
+    // check the remainder of the first word
+    uint64_t bits = mp->freeMap[word] & (~0ULL << (start % 64));
+    if(bits) return (word * 64) + __builtin_ctzll(bits);
+
+    // then use the summary to skip over fully allocated words
+    word++;
+    while(word < words) {
+        uint64_t summary = mp->freeSummary[word / 64] & (~0ULL << (word % 64));
+        if(!summary) {
+            word = ((word / 64) + 1) * 64;
+            continue;
+        }
+
+        word = ((word / 64) * 64) + __builtin_ctzll(summary);
+        if(word >= words) break;
+        return (word * 64) + __builtin_ctzll(mp->freeMap[word]);
+    }
+
+    return 0;
+}
+
+/* lxfsFreeRun(): measures a run of contiguous free blocks
+ * params: mp - mountpoint
+ * params: start - first block of the run
+ * params: max - maximum length to measure
+ * returns: number of contiguous free blocks starting at start, up to max
+ */
+
+uint64_t lxfsFreeRun(Mountpoint *mp, uint64_t start, uint64_t max) {
+    uint64_t length = 0;
+    while((length < max) && lxfsIsFree(mp, start + length)) {
+        uint64_t block = start + length;
+        if(!(block % 64) && ((max - length) >= 64) && (mp->freeMap[block / 64] == ~0ULL)) {
+            length += 64;   // whole word is free
+            continue;
+        }
+
+        length++;
+    }
+
+    return length;
+}
+
+/* lxfsFindFreeBlock(): finds a free block on the LXFS volume
+ * params: mp - mountpoint
+ * params: index - zero-based index of free blocks to return
+ * i.e. guarantee the volume has at least (index) free blocks
+ * returns: block number, zero if no space available
+ */
+
+uint64_t lxfsFindFreeBlock(Mountpoint *mp, uint64_t index) {
+    if(index >= mp->freeBlocks) return 0;
+
+    uint64_t block = lxfsNextFree(mp, 33);
+    while(block && index) {
+        block = lxfsNextFree(mp, block + 1);
+        index--;
+    }
+
+    return block;
+}
+
+/* lxfsFindRun(): finds the nearest run of free blocks large enough for a
+ * request, moving forward from a goal block and wrapping around once
+ * params: mp - mountpoint
+ * params: goal - block to start searching at
+ * params: count - number of blocks needed
+ * returns: first block of the run, zero if there is none
+ */
+
+static uint64_t lxfsFindRun(Mountpoint *mp, uint64_t goal, uint64_t count) {
+    uint64_t search = goal;
+    int wrapped = 0;
+
+    for(;;) {
+        uint64_t run = lxfsNextFree(mp, search);
+        if(wrapped && (!run || (run >= goal))) return 0;
+        if(!run) {
+            wrapped = 1;
+            search = 33;
+            continue;
+        }
+
+        uint64_t length = lxfsFreeRun(mp, run, count);
+        if(length >= count) return run;
+        search = run + length;
+    }
+}
+
+/* lxfsReserveRelease(): returns the blocks reserved for a file to free space
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * returns: nothing
+ */
+
+void lxfsReserveRelease(Mountpoint *mp, uint64_t file) {
+    for(int i = 0; i < PREALLOC_FILES; i++) {
+        Reservation *r = &mp->reservations[i];
+        if(!r->file || (r->file != file)) continue;
+
+        for(uint64_t j = 0; j < r->length; j++)
+            lxfsMarkBlock(mp, r->start + j, 1);
+
+        mp->reservedBlocks -= r->length;
+        r->file = 0;
+        r->length = 0;
+    }
+}
+
+/* lxfsReserveReleaseAll(): releases every reservation on a volume
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+void lxfsReserveReleaseAll(Mountpoint *mp) {
+    for(int i = 0; i < PREALLOC_FILES; i++) {
+        if(mp->reservations[i].file) lxfsReserveRelease(mp, mp->reservations[i].file);
+    }
+}
+
+/* lxfsReserve(): reserves the free blocks following the end of a file
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * params: start - block following the last block of the file
+ * returns: nothing
+ */
+
+static void lxfsReserve(Mountpoint *mp, uint64_t file, uint64_t start) {
+    uint64_t length = lxfsFreeRun(mp, start, PREALLOC_BLOCKS);
+    if(!length) return;
+
+    // reuse the least recently used reservation
+    Reservation *r = &mp->reservations[0];
+    for(int i = 0; i < PREALLOC_FILES; i++) {
+        if(!mp->reservations[i].file) {
+            r = &mp->reservations[i];
+            break;
+        }
+
+        if(mp->reservations[i].lastUsed < r->lastUsed) r = &mp->reservations[i];
+    }
+
+    if(r->file) lxfsReserveRelease(mp, r->file);
+
+    for(uint64_t i = 0; i < length; i++)
+        lxfsMarkBlock(mp, start + i, 0);
+
+    r->file = file;
+    r->start = start;
+    r->length = length;
+    r->lastUsed = ++mp->reserveTick;
+    mp->reservedBlocks += length;
+}
+
+/* lxfsAllocate(): allocates new blocks
+ * params: mp - mountpoint
+ * params: count - number of blocks to allocate
+ * params: goal - block to allocate after, usually the last block of the file
+ * or its parent directory, zero for no preference
+ * params: file - header block of the file being appended to, which reserves
+ * space for its next append, zero for none
+ * returns: first block in chain, zero on fail
+ */
+
+uint64_t lxfsAllocate(Mountpoint *mp, uint64_t count, uint64_t goal, uint64_t file) {
+    if(!count) return 0;
+
+    // the file's own reservation directly follows its last block, so the
+    // in-place extension below picks it up once it's released
+    if(file) lxfsReserveRelease(mp, file);
+    if(count > mp->freeBlocks) lxfsReserveReleaseAll(mp);
+    if(count > mp->freeBlocks) return 0;
+
+    TableEdit *edits = calloc(count, sizeof(TableEdit));
+    if(!edits) return 0;
+
+    if((goal < 33) || (goal >= mp->volumeSize)) goal = 33;
+
+    // extend in place if the blocks right after the goal are free, and then
+    // try to place the rest of the request in a single run
+    uint64_t found = lxfsFreeRun(mp, goal + 1, count);
+    for(uint64_t i = 0; i < found; i++)
+        edits[i].block = goal + 1 + i;
+
+    if(found < count) {
+        uint64_t run = lxfsFindRun(mp, goal + 1 + found, count - found);
+        if(run) {
+            for(uint64_t i = 0; found < count; i++)
+                edits[found++].block = run + i;
+        }
+    }
+
+    if(found < count) {
+        // no run is large enough, so gather runs of free blocks moving
+        // forward from the goal, wrapping around to the start of the volume
+        found = 0;
+        uint64_t search = goal;
+        int wrapped = 0;
+
+        while(found < count) {
+            uint64_t run = lxfsNextFree(mp, search);
+            if(wrapped && (!run || run >= goal)) break;
+            if(!run) {
+                wrapped = 1;
+                search = 33;
+                continue;
+            }
+
+            uint64_t length = lxfsFreeRun(mp, run, count - found);
+            if(wrapped && ((run + length) > goal)) length = goal - run;
+            for(uint64_t i = 0; i < length; i++)
+                edits[found++].block = run + i;
+
+            search = run + length;
+        }
+    }
+
+    if(found < count) {
+        free(edits);
+        return 0;
+    }
+
+    // link the blocks into a chain with one update per table block
+    for(uint64_t i = 0; i < count-1; i++)
+        edits[i].next = edits[i+1].block;
+    edits[count-1].next = LXFS_BLOCK_EOF;
+
+    uint64_t block = edits[0].block;
+    uint64_t last = edits[count-1].block;
+    if(lxfsSetNextBlocks(mp, edits, count)) block = 0;
+
+    free(edits);
+
+    // and keep the space after the new end of the file for the next append
+    if(block && file) lxfsReserve(mp, file, last + 1);
+    return block;
+}
+
+/* lxfsAllocateRun(): allocates a chain of physically contiguous blocks
+ * params: mp - mountpoint
+ * params: count - number of blocks to allocate
+ * params: goal - block to start searching after, zero for no preference
+ * returns: first block in chain, zero if there is no run large enough
+ */
+
+uint64_t lxfsAllocateRun(Mountpoint *mp, uint64_t count, uint64_t goal) {
+    if(!count) return 0;
+    if((goal < 33) || (goal >= mp->volumeSize)) goal = 33;
+
+    uint64_t run = lxfsFindRun(mp, goal, count);
+    if(!run && mp->reservedBlocks) {
+        lxfsReserveReleaseAll(mp);
+        run = lxfsFindRun(mp, goal, count);
+    }
+
+    if(!run) return 0;
+
+    TableEdit *edits = calloc(count, sizeof(TableEdit));
+    if(!edits) return 0;
+
+    for(uint64_t i = 0; i < count; i++) {
+        edits[i].block = run + i;
+        edits[i].next = (i == count-1) ? LXFS_BLOCK_EOF : run + i + 1;
+    }
+
+    if(lxfsSetNextBlocks(mp, edits, count)) run = 0;
+    free(edits);
+    return run;
+}
+
+/* lxfsReportFragmentation(): logs how fragmented the files on a volume are
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+void lxfsReportFragmentation(Mountpoint *mp) {
+    if(!mp->fileCount) return;
+
+    // every chain is one extent, plus one more for every non-adjacent link
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t metadata = 33 + ((mp->volumeSize + entries - 1) / entries);
+    uint64_t used = mp->volumeSize - mp->freeBlocks - mp->reservedBlocks;
+    if(used > metadata) used -= metadata;
+    else used = 0;
+
+    uint64_t extents = mp->fileCount + mp->fragments;
+    uint64_t average = (used * 10) / extents;
+    uint64_t perFile = (extents * 10) / mp->fileCount;
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: %d files in %d extents, average extent %d.%d blocks, %d.%d extents per file\n",
+        mp->device, mp->fileCount, extents, average / 10, average % 10, perFile / 10, perFile % 10);
+}
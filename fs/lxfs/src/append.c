@@ -0,0 +1,163 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Log-style writers append a few bytes at a time, and writing the last block,
+ * the file header and the timestamps in the directory entry for each of them
+ * costs far more than the data itself. Appends through an open handle that
+ * fit in the space left in the last block of a file are instead copied
+ * straight into that block in the cache, while the new size is kept in the
+ * handles of the file and the header and timestamps are only written once
+ * for a whole series of appends. That happens when the oldest of them is
+ * APPEND_DELAY seconds old, when an append doesn't fit in the last block,
+ * on fsync() and close(), and before any request that could look at the
+ * file other than reads and writes through its handles.
+ */
+
+/* lxfsAppendFind(): returns the pending appends of a file
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * returns: pointer to the pending appends, NULL if there are none
+ */
+
+static PendingAppend *lxfsAppendFind(Mountpoint *mp, uint64_t file) {
+    for(int i = 0; i < APPEND_FILES; i++) {
+        if(mp->appends[i].file == file) return &mp->appends[i];
+    }
+
+    return NULL;
+}
+
+/* lxfsAppendWrite(): writes the header and timestamps of a file with pending
+ * appends and forgets about them
+ * params: mp - mountpoint
+ * params: pending - pending appends
+ * returns: zero on success
+ */
+
+static int lxfsAppendWrite(Mountpoint *mp, PendingAppend *pending) {
+    int status = lxfsWritePartial(mp, pending->file, pending->file, offsetof(LXFSFileHeader, size),
+                                  &pending->size, sizeof(uint64_t))
+        || lxfsWriteTimestamps(mp, pending->dirBlock, pending->dirOffset, pending->modTime);
+    if(!status) {
+        lxfsDentryTouch(mp, pending->path, pending->modTime, pending->modTime);
+        mp->appendCommits++;
+    }
+
+    free(pending->path);
+    memset(pending, 0, sizeof(PendingAppend));
+    return status;
+}
+
+/* lxfsAppendAbsorb(): absorbs a small append into the last block of a file
+ * params: mp - mountpoint
+ * params: handle - handle of the open file
+ * params: position - offset within the file to write at
+ * params: data - data to write
+ * params: length - number of bytes to write
+ * returns: zero if the append was absorbed, non-zero if it must be written
+ * the usual way after committing the pending appends of the file
+ */
+
+int lxfsAppendAbsorb(Mountpoint *mp, Handle *handle, off_t position, const void *data, size_t length) {
+    // only appends that leave room in the last block are absorbed, so that
+    // filling it up commits the pending ones
+    off_t offset = position % mp->blockSizeBytes;
+    if(!length || (position != handle->header.size) || !offset
+    || ((offset + length) >= mp->blockSizeBytes)) return 1;
+    if(!handle->tail || (handle->first == LXFS_BLOCK_EOF)) return 1;
+
+    PendingAppend *pending = lxfsAppendFind(mp, handle->file);
+    if(!pending) {
+        if(lxfsNextBlock(mp, handle->tail) != LXFS_BLOCK_EOF) return 1;
+
+        // take a free record, or commit the one that has waited the longest
+        pending = &mp->appends[0];
+        for(int i = 0; i < APPEND_FILES; i++) {
+            if(!mp->appends[i].file) {
+                pending = &mp->appends[i];
+                break;
+            }
+
+            if(mp->appends[i].since < pending->since) pending = &mp->appends[i];
+        }
+
+        uint64_t file = pending->file;
+        if(file && lxfsAppendWrite(mp, pending))
+            luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to update file at block %d after appending\n", mp->device, file);
+
+        pending->path = strdup(handle->path);
+        if(!pending->path) return 1;
+
+        pending->file = handle->file;
+        pending->dirBlock = handle->dirBlock;
+        pending->dirOffset = handle->dirOffset;
+        pending->size = handle->header.size;
+        pending->first = handle->first;
+        pending->tail = handle->tail;
+        pending->since = time(NULL);
+    }
+
+    Cache *slot = lxfsBorrowBlock(mp, pending->tail);
+    if(!slot) return 1;
+
+    memcpy(slot->data + offset, data, length);
+    lxfsMarkDirty(mp, slot, pending->file);
+    lxfsReturnBlock(slot);
+
+    pending->size += length;
+    pending->modTime = time(NULL);
+    mp->absorbedAppends++;
+
+    // reads through the handles of the file go by the size they have
+    LXFSFileHeader header;
+    memcpy(&header, &handle->header, sizeof(LXFSFileHeader));
+    header.size = pending->size;
+    lxfsHandleUpdate(mp, pending->file, &header, pending->first, pending->tail);
+    return 0;
+}
+
+/* lxfsAppendCommit(): writes the header and timestamps of a file after the
+ * appends absorbed into it, if there are any
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * returns: zero on success
+ */
+
+int lxfsAppendCommit(Mountpoint *mp, uint64_t file) {
+    PendingAppend *pending = lxfsAppendFind(mp, file);
+    if(!pending || !file) return 0;
+    return lxfsAppendWrite(mp, pending);
+}
+
+/* lxfsAppendCommitAll(): writes the header and timestamps of every file with
+ * absorbed appends that have waited long enough
+ * params: mp - mountpoint
+ * params: age - minimum age of the oldest absorbed append in seconds, zero
+ *   to commit all of them
+ * returns: zero on success
+ */
+
+int lxfsAppendCommitAll(Mountpoint *mp, time_t age) {
+    time_t now = age ? time(NULL) : 0;
+    int status = 0;
+
+    for(int i = 0; i < APPEND_FILES; i++) {
+        PendingAppend *pending = &mp->appends[i];
+        if(!pending->file || (age && ((now - pending->since) < age))) continue;
+
+        if(lxfsAppendWrite(mp, pending)) status = 1;
+    }
+
+    return status;
+}
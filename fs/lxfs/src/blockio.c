@@ -10,6 +10,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* lxfsCacheInit(): allocates the block cache of a mountpoint
+ * params: mp - mountpoint
+ * params: size - requested capacity in blocks, rounded down to whole sets
+ * returns: zero on success
+ */
+
+int lxfsCacheInit(Mountpoint *mp, uint64_t size) {
+    // don't cache more blocks than the volume actually has
+    if(size > mp->volumeSize) size = mp->volumeSize;
+
+    mp->cacheWays = CACHE_WAYS;
+    mp->cacheSets = size / CACHE_WAYS;
+    if(!mp->cacheSets) mp->cacheSets = 1;
+
+    mp->cache = calloc(mp->cacheSets * mp->cacheWays, sizeof(Cache));
+    if(!mp->cache) return 1;
+
+    mp->flushBuffer = malloc(FLUSH_BATCH * mp->blockSizeBytes);
+    if(!mp->flushBuffer) {
+        free(mp->cache);
+        return 1;
+    }
+
+    mp->cacheTick = 0;
+    mp->cacheHits = 0;
+    mp->cacheMisses = 0;
+    mp->cacheEvictions = 0;
+    return 0;
+}
+
 /* lxfsFlushSlot(): flush a slot from the cache to the physical drive
  * params: mp - mountpoint
  * params: index - cache slot index
@@ -18,16 +48,97 @@
 
 int lxfsFlushSlot(Mountpoint *mp, uint64_t index) {
     if(!mp->cache[index].valid || !mp->cache[index].dirty) return 0;
-    uint64_t block = (mp->cache[index].tag*CACHE_SIZE) + (index%CACHE_SIZE);
+    uint64_t block = mp->cache[index].tag;
 
     lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
     ssize_t s = write(mp->fd, mp->cache[index].data, mp->blockSizeBytes);
     if(s != mp->blockSizeBytes) return 1;
 
-    mp->cache[index].dirty = 0;
+    lxfsMarkClean(mp, &mp->cache[index]);
+    mp->flushedBlocks++;
+    mp->flushWrites++;
     return 0;
 }
 
+/* lxfsCacheFind(): looks up a block in the cache
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: pointer to the cache slot holding the block, NULL if not cached
+ */
+
+static Cache *lxfsCacheFind(Mountpoint *mp, uint64_t block) {
+    Cache *set = &mp->cache[(block % mp->cacheSets) * mp->cacheWays];
+    for(int i = 0; i < mp->cacheWays; i++) {
+        if(set[i].valid && (set[i].tag == block)) {
+            set[i].lastUsed = ++mp->cacheTick;
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* lxfsCacheReplace(): claims a cache slot for a block that isn't cached
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: pointer to the claimed slot with a data buffer, NULL on fail
+ */
+
+static Cache *lxfsCacheReplace(Mountpoint *mp, uint64_t block) {
+    uint64_t first = (block % mp->cacheSets) * mp->cacheWays;
+    Cache *set = &mp->cache[first];
+
+    // prefer an unused way, otherwise evict the least recently used one that
+    // isn't borrowed
+    int victim = -1;
+    for(int i = 0; i < mp->cacheWays; i++) {
+        if(!set[i].valid) {
+            victim = i;
+            break;
+        }
+
+        if(set[i].pins) continue;
+        if((victim < 0) || (set[i].lastUsed < set[victim].lastUsed)) victim = i;
+    }
+
+    if(victim < 0) return NULL;
+
+    if(set[victim].valid) {
+        if(set[victim].dirty && lxfsFlushSlot(mp, first + victim)) return NULL;
+        if(set[victim].prefetched) mp->prefetchWasted++;
+        mp->cacheEvictions++;
+    }
+
+    if(!set[victim].data) set[victim].data = malloc(mp->blockSizeBytes);
+    if(!set[victim].data) {
+        set[victim].valid = 0;
+        return NULL;
+    }
+
+    set[victim].valid = 1;
+    set[victim].dirty = 0;
+    set[victim].prefetched = 0;
+    set[victim].pins = 0;
+    set[victim].owner = 0;
+    set[victim].tag = block;
+    set[victim].lastUsed = ++mp->cacheTick;
+    return &set[victim];
+}
+
+/* lxfsCacheHit(): accounts for a read served from the cache
+ * params: mp - mountpoint
+ * params: slot - cache slot holding the block
+ * returns: nothing
+ */
+
+static void lxfsCacheHit(Mountpoint *mp, Cache *slot) {
+    mp->cacheHits++;
+    if(slot->prefetched) {
+        slot->prefetched = 0;
+        mp->prefetchHits++;
+    }
+}
+
 /* lxfsFlushBlock(): checks if a block is in the cache and flushes it if needed
  * params: mp - mountpoint
  * params: block - block number
@@ -35,12 +146,37 @@ int lxfsFlushSlot(Mountpoint *mp, uint64_t index) {
  */
 
 int lxfsFlushBlock(Mountpoint *mp, uint64_t block) {
-    uint64_t tag = block / CACHE_SIZE;
-    uint64_t i = block % CACHE_SIZE;
+    Cache *slot = lxfsCacheFind(mp, block);
+    if(!slot || !slot->dirty) return 0;
+    return lxfsFlushSlot(mp, slot - mp->cache);
+}
 
-    if(!mp->cache[i].valid || !mp->cache[i].dirty || (mp->cache[i].tag != tag))
-        return 0;
-    return lxfsFlushSlot(mp, i);
+/* lxfsCacheLoad(): returns the cache slot holding a block, reading it from
+ * the device if it isn't cached
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: pointer to the cache slot, NULL on fail
+ */
+
+static Cache *lxfsCacheLoad(Mountpoint *mp, uint64_t block) {
+    Cache *slot = lxfsCacheFind(mp, block);
+    if(slot) {
+        lxfsCacheHit(mp, slot);
+        return slot;
+    }
+
+    mp->cacheMisses++;
+    slot = lxfsCacheReplace(mp, block);
+    if(!slot) return NULL;
+
+    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
+    ssize_t s = read(mp->fd, slot->data, mp->blockSizeBytes);
+    if(s != mp->blockSizeBytes) {
+        slot->valid = 0;
+        return NULL;
+    }
+
+    return slot;
 }
 
 /* lxfsReadBlock(): reads a block on a mounted lxfs partition
@@ -51,42 +187,190 @@ int lxfsFlushBlock(Mountpoint *mp, uint64_t block) {
  */
 
 int lxfsReadBlock(Mountpoint *mp, uint64_t block, void *buffer) {
-    // check if the block is already in the cache
-    uint64_t tag = block / CACHE_SIZE;
-    uint64_t index = block % CACHE_SIZE;
+    Cache *slot = lxfsCacheLoad(mp, block);
+    if(!slot) return 1;
 
-    if(mp->cache[index].valid && (mp->cache[index].tag == tag)) {
-        memcpy(buffer, mp->cache[index].data, mp->blockSizeBytes);
-        return 0;
-    }
+    memcpy(buffer, slot->data, mp->blockSizeBytes);
+    return 0;
+}
+
+/* lxfsBorrowBlock(): gives read access to a block in place in the cache,
+ * without copying it out; the slot stays pinned and can't be evicted until
+ * it is returned, so other blocks can be accessed in the meantime
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: pointer to the pinned cache slot, NULL on fail
+ */
 
-    // flush the cache if necessary
-    if(mp->cache[index].valid && mp->cache[index].dirty) {
-        if(lxfsFlushSlot(mp, index)) return 1;
+Cache *lxfsBorrowBlock(Mountpoint *mp, uint64_t block) {
+    Cache *slot = lxfsCacheLoad(mp, block);
+    if(slot) slot->pins++;
+    return slot;
+}
+
+/* lxfsReturnBlock(): unpins a block borrowed with lxfsBorrowBlock()
+ * params: slot - cache slot
+ * returns: nothing
+ */
+
+void lxfsReturnBlock(Cache *slot) {
+    if(slot && slot->pins) slot->pins--;
+}
+
+/* lxfsReadBlocks(): reads a physically contiguous run of blocks
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsReadBlocks(Mountpoint *mp, uint64_t block, uint64_t count, void *buffer) {
+    uint64_t i = 0;
+    while(i < count) {
+        // cached blocks may be newer than what's on the disk
+        Cache *slot = lxfsCacheFind(mp, block + i);
+        if(slot) {
+            lxfsCacheHit(mp, slot);
+            memcpy(buffer + (i * mp->blockSizeBytes), slot->data, mp->blockSizeBytes);
+            i++;
+            continue;
+        }
+
+        // coalesce everything up to the next cached block into one request
+        uint64_t length = 1;
+        while(((i + length) < count) && !lxfsCacheFind(mp, block + i + length))
+            length++;
+
+        void *data = buffer + (i * mp->blockSizeBytes);
+        lseek(mp->fd, (block + i) * mp->blockSizeBytes, SEEK_SET);
+        ssize_t s = read(mp->fd, data, length * mp->blockSizeBytes);
+        if(s != (length * mp->blockSizeBytes)) return 1;
+
+        // and keep a copy of each block in the cache
+        mp->cacheMisses += length;
+        for(uint64_t j = 0; j < length; j++) {
+            slot = lxfsCacheReplace(mp, block + i + j);
+            if(!slot) return 1;
+            memcpy(slot->data, data + (j * mp->blockSizeBytes), mp->blockSizeBytes);
+        }
+
+        i += length;
     }
 
-    mp->cache[index].valid = 1;
-    mp->cache[index].dirty = 0;
-    mp->cache[index].tag = tag;
+    return 0;
+}
+
+/* lxfsReadBlocksDirect(): reads a physically contiguous run of blocks
+ * without keeping them in the cache, for reads that won't be repeated
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
 
-    if(!mp->cache[index].data) mp->cache[index].data = malloc(mp->blockSizeBytes);
-    if(!mp->cache[index].data) {
-        mp->cache[index].valid = 0;
-        return 1;
+int lxfsReadBlocksDirect(Mountpoint *mp, uint64_t block, uint64_t count, void *buffer) {
+    uint64_t i = 0;
+    while(i < count) {
+        // cached blocks may be newer than what's on the disk
+        Cache *slot = lxfsCacheFind(mp, block + i);
+        if(slot) {
+            memcpy(buffer + (i * mp->blockSizeBytes), slot->data, mp->blockSizeBytes);
+            i++;
+            continue;
+        }
+
+        uint64_t length = 1;
+        while(((i + length) < count) && !lxfsCacheFind(mp, block + i + length))
+            length++;
+
+        ssize_t size = length * mp->blockSizeBytes;
+        lseek(mp->fd, (block + i) * mp->blockSizeBytes, SEEK_SET);
+        if(read(mp->fd, buffer + (i * mp->blockSizeBytes), size) != size) return 1;
+
+        i += length;
     }
 
-    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
-    ssize_t s = read(mp->fd, mp->cache[index].data, mp->blockSizeBytes);
-    if(s != mp->blockSizeBytes) {
-        mp->cache[index].valid = 0;
-        return 1;
+    return 0;
+}
+
+/* lxfsCacheDrop(): discards the cached copy of a block that was freed
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: nothing
+ */
+
+void lxfsCacheDrop(Mountpoint *mp, uint64_t block) {
+    Cache *slot = lxfsCacheFind(mp, block);
+    if(!slot || slot->pins) return;
+
+    lxfsMarkClean(mp, slot);
+    slot->valid = 0;
+}
+
+/* lxfsPrefetchBlocks(): reads a physically contiguous run of blocks ahead of
+ * time, leaving them in the cache only
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks, at most the read-ahead window
+ * returns: zero on success
+ */
+
+int lxfsPrefetchBlocks(Mountpoint *mp, uint64_t block, uint64_t count) {
+    if(!mp->prefetchBuffer || (count > mp->readahead)) return 1;
+
+    uint64_t i = 0;
+    while(i < count) {
+        // skip blocks that are cached already or that read as zeroes
+        if(lxfsCacheFind(mp, block + i) || lxfsIsUnwritten(mp, block + i)) {
+            i++;
+            continue;
+        }
+
+        uint64_t length = 1;
+        while(((i + length) < count) && !lxfsCacheFind(mp, block + i + length)
+        && !lxfsIsUnwritten(mp, block + i + length))
+            length++;
+
+        lseek(mp->fd, (block + i) * mp->blockSizeBytes, SEEK_SET);
+        ssize_t s = read(mp->fd, mp->prefetchBuffer, length * mp->blockSizeBytes);
+        if(s != (length * mp->blockSizeBytes)) return 1;
+
+        for(uint64_t j = 0; j < length; j++) {
+            Cache *slot = lxfsCacheReplace(mp, block + i + j);
+            if(!slot) return 1;
+            memcpy(slot->data, mp->prefetchBuffer + (j * mp->blockSizeBytes), mp->blockSizeBytes);
+            slot->prefetched = 1;
+        }
+
+        mp->prefetched += length;
+        i += length;
     }
 
-    memcpy(buffer, mp->cache[index].data, mp->blockSizeBytes);
     return 0;
 }
 
-/* lxfsWriteBlock(): writes a block to a mounted lxfs partition
+/* lxfsCacheWrite(): writes a block into the cache, to be written back later
+ * params: mp - mountpoint
+ * params: block - block number
+ * params: buffer - buffer to write from
+ * params: owner - header block of the file the block belongs to, zero if shared
+ * returns: zero on success
+ */
+
+static int lxfsCacheWrite(Mountpoint *mp, uint64_t block, const void *buffer, uint64_t owner) {
+    Cache *slot = lxfsCacheFind(mp, block);
+    if(!slot) slot = lxfsCacheReplace(mp, block);
+    if(!slot) return 1;
+
+    memcpy(slot->data, buffer, mp->blockSizeBytes);
+    slot->prefetched = 0;
+    lxfsMarkDirty(mp, slot, owner);
+    return 0;
+}
+
+/* lxfsWriteBlock(): writes a metadata block to a mounted lxfs partition
  * params: mp - mountpoint
  * params: block - block number
  * params: buffer - buffer to write from
@@ -94,51 +378,107 @@ int lxfsReadBlock(Mountpoint *mp, uint64_t block, void *buffer) {
  */
 
 int lxfsWriteBlock(Mountpoint *mp, uint64_t block, const void *buffer) {
-    uint64_t tag = block / CACHE_SIZE;
-    uint64_t index = block % CACHE_SIZE;
+    return lxfsCacheWrite(mp, block, buffer, 0);
+}
 
-    if(mp->cache[index].valid && (mp->cache[index].tag == tag)) {
-        memcpy(mp->cache[index].data, buffer, mp->blockSizeBytes);
-        mp->cache[index].dirty = 1;
-        return 0;
-    }
+/* lxfsWriteFileBlock(): writes a block belonging to a single file
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * params: block - block number
+ * params: buffer - buffer to write from
+ * returns: zero on success
+ */
 
-    if(mp->cache[index].valid && mp->cache[index].dirty) {
-        if(lxfsFlushSlot(mp, index)) return 1;
-    }
+int lxfsWriteFileBlock(Mountpoint *mp, uint64_t file, uint64_t block, const void *buffer) {
+    return lxfsCacheWrite(mp, block, buffer, file);
+}
+
+/* lxfsWritePartial(): writes part of a block in place in the cache, to be
+ * written back later
+ * params: mp - mountpoint
+ * params: file - header block of the file the block belongs to, zero if shared
+ * params: block - block number
+ * params: offset - offset within the block
+ * params: buffer - buffer to write from
+ * params: length - number of bytes, continuing into the next block in the
+ * chain if the write crosses the end of this one
+ * returns: zero on success
+ */
+
+int lxfsWritePartial(Mountpoint *mp, uint64_t file, uint64_t block, off_t offset,
+                     const void *buffer, size_t length) {
+    while(length) {
+        if(offset >= mp->blockSizeBytes) {
+            block = lxfsNextBlock(mp, block);
+            if(!block || (block == LXFS_BLOCK_EOF)) return 1;
+            offset -= mp->blockSizeBytes;
+        }
 
-    mp->cache[index].valid = 1;
-    mp->cache[index].dirty = 1;
-    mp->cache[index].tag = tag;
+        Cache *slot = lxfsCacheLoad(mp, block);
+        if(!slot) return 1;
 
-    if(!mp->cache[index].data) mp->cache[index].data = malloc(mp->blockSizeBytes);
-    if(!mp->cache[index].data) {
-        mp->cache[index].valid = 0;
-        return 1;
+        size_t part = mp->blockSizeBytes - offset;
+        if(part > length) part = length;
+
+        memcpy(slot->data + offset, buffer, part);
+        slot->prefetched = 0;
+        lxfsMarkDirty(mp, slot, file);
+
+        buffer = (const void *)((uintptr_t) buffer + part);
+        length -= part;
+        offset += part;
     }
 
-    memcpy(mp->cache[index].data, buffer, mp->blockSizeBytes);
     return 0;
 }
 
-/* lxfsNextBlock(): returns the next block in a chain of blocks
+/* lxfsTableEntry(): returns the block table entry of a block as it is stored
  * params: mp - mountpoint
- * params: block - current block number
- * returns: next block number, zero on fail
+ * params: block - block number
+ * returns: table entry including flags, zero on fail
  */
 
-uint64_t lxfsNextBlock(Mountpoint *mp, uint64_t block) {
+static uint64_t lxfsTableEntry(Mountpoint *mp, uint64_t block) {
+    if(mp->table) {
+        if(block >= (mp->tableSize * (mp->blockSizeBytes / 8))) return 0;
+        return mp->table[block];
+    }
+
     // read the relevant part of the block table
     uint64_t tableBlock = block / (mp->blockSizeBytes / 8);
     tableBlock += 33;   // the first 33 blocks are reserved
     uint64_t tableIndex = block % (mp->blockSizeBytes / 8);
 
-    if(lxfsReadBlock(mp, tableBlock, mp->blockTableBuffer)) return 0;
+    // which is only read in place
+    Cache *slot = lxfsCacheLoad(mp, tableBlock);
+    if(!slot) return 0;
 
-    uint64_t *data = (uint64_t *) mp->blockTableBuffer;
+    uint64_t *data = (uint64_t *) slot->data;
     return data[tableIndex];
 }
 
+/* lxfsNextBlock(): returns the next block in a chain of blocks
+ * params: mp - mountpoint
+ * params: block - current block number
+ * returns: next block number, zero on fail
+ */
+
+uint64_t lxfsNextBlock(Mountpoint *mp, uint64_t block) {
+    uint64_t entry = lxfsTableEntry(mp, block);
+    return LXFS_NEXT(entry);
+}
+
+/* lxfsIsUnwritten(): checks if a block of a sparse file has never been written
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: non-zero if the block should be read as zeroes
+ */
+
+int lxfsIsUnwritten(Mountpoint *mp, uint64_t block) {
+    uint64_t entry = lxfsTableEntry(mp, block);
+    return LXFS_UNWRITTEN(entry);
+}
+
 /* lxfsReadNextBlock(): reads a block and returns the next block in its chain
  * params: mp - mountpoint
  * params: block - block number
@@ -151,6 +491,137 @@ uint64_t lxfsReadNextBlock(Mountpoint *mp, uint64_t block, void *buffer) {
     return lxfsNextBlock(mp, block);
 }
 
+/* lxfsReadChain(): reads consecutive blocks of a chain
+ * params: mp - mountpoint
+ * params: block - first block to read, updated to the block following the
+ *   last one read, which is LXFS_BLOCK_EOF at the end and zero on fail
+ * params: count - maximum number of blocks to read
+ * params: buffer - buffer to read into
+ * returns: number of blocks read
+ */
+
+uint64_t lxfsReadChain(Mountpoint *mp, uint64_t *block, uint64_t count, void *buffer) {
+    uint64_t total = 0;
+    while((total < count) && *block && (*block != LXFS_BLOCK_EOF)) {
+        // find how far the chain continues in physically adjacent blocks that
+        // are either all written or all unwritten, so the whole run can be
+        // read from the device in a single request
+        uint64_t start = *block;
+        uint64_t entry = lxfsTableEntry(mp, start);
+        int unwritten = LXFS_UNWRITTEN(entry);
+        uint64_t length = 1;
+        *block = LXFS_NEXT(entry);
+
+        while(((total + length) < count) && (*block == (start + length))) {
+            entry = lxfsTableEntry(mp, *block);
+            if(LXFS_UNWRITTEN(entry) != unwritten) break;
+            *block = LXFS_NEXT(entry);
+            length++;
+        }
+
+        if(unwritten) {
+            // holes in sparse files don't need to be read at all
+            memset(buffer + (total * mp->blockSizeBytes), 0, length * mp->blockSizeBytes);
+        } else if(lxfsReadBlocks(mp, start, length, buffer + (total * mp->blockSizeBytes))) {
+            *block = 0;
+            break;
+        }
+
+        total += length;
+    }
+
+    return total;
+}
+
+/* lxfsStreamBlocks(): writes a physically contiguous run of blocks straight
+ * to the device, bypassing the cache
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * params: buffer - buffer to write from
+ * returns: zero on success
+ */
+
+int lxfsStreamBlocks(Mountpoint *mp, uint64_t block, uint64_t count, const void *buffer) {
+    ssize_t size = count * mp->blockSizeBytes;
+    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
+    if(write(mp->fd, buffer, size) != size) return 1;
+
+    // cached copies are now out of date, and dirty ones must not be written
+    // back over the new data
+    for(uint64_t i = 0; i < count; i++) {
+        Cache *slot = lxfsCacheFind(mp, block + i);
+        if(!slot) continue;
+
+        lxfsMarkClean(mp, slot);
+        if(slot->pins) memcpy(slot->data, buffer + (i * mp->blockSizeBytes), mp->blockSizeBytes);
+        else slot->valid = 0;
+    }
+
+    mp->streamedBlocks += count;
+    mp->streamWrites++;
+    return 0;
+}
+
+/* lxfsWriteChain(): writes whole consecutive blocks of a file's chain, with
+ * long physically contiguous runs written straight to the device
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * params: block - first block to write, updated to the block following the
+ *   last one written, which is LXFS_BLOCK_EOF at the end and zero on fail
+ * params: count - maximum number of blocks to write
+ * params: buffer - buffer to write from
+ * params: last - pointer to store the last block written
+ * returns: number of blocks written
+ */
+
+uint64_t lxfsWriteChain(Mountpoint *mp, uint64_t file, uint64_t *block, uint64_t count,
+                        const void *buffer, uint64_t *last) {
+    uint64_t total = 0;
+    while((total < count) && *block && (*block != LXFS_BLOCK_EOF)) {
+        // find how far the chain continues in physically adjacent blocks
+        uint64_t start = *block;
+        uint64_t length = 0;
+        int unwritten = 0;
+        do {
+            uint64_t entry = lxfsTableEntry(mp, *block);
+            if(LXFS_UNWRITTEN(entry)) unwritten = 1;
+            *block = LXFS_NEXT(entry);
+            length++;
+        } while(((total + length) < count) && (*block == (start + length)));
+
+        const void *data = buffer + (total * mp->blockSizeBytes);
+        if(length >= STREAM_MIN) {
+            if(lxfsStreamBlocks(mp, start, length, data)) {
+                *block = 0;
+                break;
+            }
+        } else {
+            // short runs are better off left to the write-back cache
+            for(uint64_t i = 0; i < length; i++) {
+                if(lxfsWriteFileBlock(mp, file, start + i, data + (i * mp->blockSizeBytes))) {
+                    *block = 0;
+                    return total;
+                }
+            }
+        }
+
+        // and blocks in a hole hold data now
+        for(uint64_t i = 0; unwritten && (i < length); i++) {
+            uint64_t entry = lxfsTableEntry(mp, start + i);
+            if(LXFS_UNWRITTEN(entry) && lxfsSetNextBlock(mp, start + i, LXFS_NEXT(entry))) {
+                *block = 0;
+                return total;
+            }
+        }
+
+        *last = start + length - 1;
+        total += length;
+    }
+
+    return total;
+}
+
 /* lxfsWriteNextBlock(): writes a block and returns the next block in its chain
  * params: mp - mountpoint
  * params: block - block number
@@ -163,23 +634,40 @@ uint64_t lxfsWriteNextBlock(Mountpoint *mp, uint64_t block, const void *buffer)
     return lxfsNextBlock(mp, block);
 }
 
-/* lxfsFindFreeBlock(): finds a free block on the LXFS volume
+/* lxfsWriteNextFileBlock(): writes a block of a file and returns the next block
  * params: mp - mountpoint
- * params: index - zero-based index of free blocks to return
- * i.e. guarantee the volume has at least (index) free blocks
- * returns: block number, zero if no space available
- */
-
-uint64_t lxfsFindFreeBlock(Mountpoint *mp, uint64_t index) {
-    uint64_t block;
-    uint64_t current = 0;
-    for(uint64_t i = 33; i < mp->volumeSize; i++) {
-        block = lxfsNextBlock(mp, i);
-        if(block == LXFS_BLOCK_FREE) current++;
-        if(current > index) return i;
-    }
+ * params: file - header block of the file
+ * params: block - block number
+ * params: buffer - buffer to write from
+ * returns: next block number, zero on fail
+ */
 
-    return 0;
+uint64_t lxfsWriteNextFileBlock(Mountpoint *mp, uint64_t file, uint64_t block, const void *buffer) {
+    if(lxfsWriteFileBlock(mp, file, block, buffer)) return 0;
+    return lxfsNextBlock(mp, block);
+}
+
+/* lxfsTableUpdate(): updates an entry in a loaded block table block
+ * params: mp - mountpoint
+ * params: data - loaded block table block
+ * params: block - block to modify
+ * params: next - next block in chain
+ * returns: nothing
+ */
+
+static void lxfsTableUpdate(Mountpoint *mp, uint64_t *data, uint64_t block, uint64_t next) {
+    uint64_t tableIndex = block % (mp->blockSizeBytes / 8);
+    uint64_t old = data[tableIndex];
+    data[tableIndex] = next;
+    lxfsMarkBlock(mp, block, next == LXFS_BLOCK_FREE);
+
+    // every chain ends in exactly one EOF marker, so this counts files
+    if((old == LXFS_BLOCK_EOF) && (next != LXFS_BLOCK_EOF)) mp->fileCount--;
+    else if((old != LXFS_BLOCK_EOF) && (next == LXFS_BLOCK_EOF)) mp->fileCount++;
+
+    // and every link that jumps elsewhere starts a new extent
+    if(LXFS_FRAGMENTED(block, old)) mp->fragments--;
+    if(LXFS_FRAGMENTED(block, next)) mp->fragments++;
 }
 
 /* lxfsSetNextBlock(): sets the next block in a chain
@@ -191,50 +679,122 @@ uint64_t lxfsFindFreeBlock(Mountpoint *mp, uint64_t index) {
 
 int lxfsSetNextBlock(Mountpoint *mp, uint64_t block, uint64_t next) {
     uint64_t tableBlock = block / (mp->blockSizeBytes / 8);
+
+    if(mp->table) {
+        if(tableBlock >= mp->tableSize) return 1;
+        lxfsTableUpdate(mp, mp->table + (tableBlock * (mp->blockSizeBytes / 8)), block, next);
+        lxfsTableMarkDirty(mp, tableBlock);
+        return 0;
+    }
+
     tableBlock += 33;   // the first 33 blocks are reserved
-    uint64_t tableIndex = block % (mp->blockSizeBytes / 8);
 
     if(lxfsReadBlock(mp, tableBlock, mp->blockTableBuffer)) return 1;
+    lxfsTableUpdate(mp, (uint64_t *) mp->blockTableBuffer, block, next);
 
-    uint64_t *data = (uint64_t *) mp->blockTableBuffer;
-    data[tableIndex] = next;
-    if(lxfsWriteBlock(mp, tableBlock, mp->blockTableBuffer)) return 1;
-    return lxfsFlushBlock(mp, tableBlock);
+    // the table block is written back along with the other dirty blocks
+    return lxfsWriteBlock(mp, tableBlock, mp->blockTableBuffer);
+}
+
+/* compareEdits(): comparison function for sorting table edits by block */
+
+static int compareEdits(const void *a, const void *b) {
+    uint64_t x = ((const TableEdit *) a)->block;
+    uint64_t y = ((const TableEdit *) b)->block;
+    return (x > y) - (x < y);
 }
 
-/* lxfsAllocate(): allocates new blocks
+/* lxfsSetNextBlocks(): applies a batch of block table updates, reading and
+ * writing each affected block table block only once
  * params: mp - mountpoint
- * params: count - number of blocks to allocate
- * returns: first block in chain, zero on fail
+ * params: edits - updates to apply, sorted in place, each block at most once
+ * params: count - number of updates
+ * returns: zero on success
  */
 
-uint64_t lxfsAllocate(Mountpoint *mp, uint64_t count) {
-    uint64_t *blocks = calloc(count, sizeof(uint64_t));
-    if(!blocks) return 0;
-
-    for(uint64_t i = 0; i < count; i++) {
-        blocks[i] = lxfsFindFreeBlock(mp, i);
-        if(!blocks[i]) {
-            free(blocks);
-            return 0;
+int lxfsSetNextBlocks(Mountpoint *mp, TableEdit *edits, size_t count) {
+    qsort(edits, count, sizeof(TableEdit), compareEdits);
+
+    uint64_t entries = mp->blockSizeBytes / 8;
+    size_t i = 0;
+    while(i < count) {
+        uint64_t tableBlock = edits[i].block / entries;
+        uint64_t *data = (uint64_t *) mp->blockTableBuffer;
+        if(mp->table) {
+            if(tableBlock >= mp->tableSize) return 1;
+            data = mp->table + (tableBlock * entries);
+        } else if(lxfsReadBlock(mp, tableBlock + 33, data)) {
+            return 1;
         }
+
+        // entries in the same table block are adjacent after sorting
+        for(; (i < count) && ((edits[i].block / entries) == tableBlock); i++)
+            lxfsTableUpdate(mp, data, edits[i].block, edits[i].next);
+
+        if(mp->table) lxfsTableMarkDirty(mp, tableBlock);
+        else if(lxfsWriteBlock(mp, tableBlock + 33, data)) return 1;
     }
 
-    for(uint64_t i = 0; i < count-1; i++) {
-        if(lxfsSetNextBlock(mp, blocks[i], blocks[i+1])) {
-            free(blocks);
-            return 0;
+    return 0;
+}
+
+/* lxfsFreeChain(): frees every block in a chain
+ * params: mp - mountpoint
+ * params: first - first block of the chain
+ * returns: zero on success
+ */
+
+int lxfsFreeChain(Mountpoint *mp, uint64_t first) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+    size_t count = 0, capacity = 64;
+    TableEdit *edits = malloc(capacity * sizeof(TableEdit));
+    if(!edits) return 1;
+
+    // walk the chain, only reading each table block when we move into it
+    uint64_t loaded = 0;
+    uint64_t block = first;
+    while(block && (block != LXFS_BLOCK_EOF) && (count < mp->volumeSize)) {
+        uint64_t tableBlock = (block / entries) + 33;
+        if(!mp->table && (tableBlock != loaded)) {
+            if(lxfsReadBlock(mp, tableBlock, mp->blockTableBuffer)) {
+                free(edits);
+                return 1;
+            }
+
+            loaded = tableBlock;
         }
+
+        if(count >= capacity) {
+            capacity *= 2;
+            TableEdit *newEdits = realloc(edits, capacity * sizeof(TableEdit));
+            if(!newEdits) {
+                free(edits);
+                return 1;
+            }
+
+            edits = newEdits;
+        }
+
+        edits[count].block = block;
+        edits[count].next = LXFS_BLOCK_FREE;
+        count++;
+
+        if(mp->table) block = lxfsTableEntry(mp, block);
+        else block = ((uint64_t *) mp->blockTableBuffer)[block % entries];
+        block = LXFS_NEXT(block);
     }
-    
-    if(lxfsSetNextBlock(mp, blocks[count-1], LXFS_BLOCK_EOF)) {
-        free(blocks);
-        return 0;
+
+    int status = lxfsSetNextBlocks(mp, edits, count);
+
+    // dirty data left in the cache for freed blocks belongs to nobody now,
+    // and mustn't be written over whatever the blocks are reused for
+    if(!status) {
+        for(size_t i = 0; i < count; i++)
+            lxfsCacheDrop(mp, edits[i].block);
     }
 
-    uint64_t block = blocks[0];
-    free(blocks);
-    return block;
+    free(edits);
+    return status;
 }
 
 /* lxfsGetBlock(): returns the block containing the nth byte of a file
@@ -0,0 +1,216 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every open file gets a lazily built run-length index of its data chain,
+ * keyed by the unique ID the kernel assigns to the open file. Each extent
+ * maps a run of logical blocks to physically contiguous blocks, so that
+ * translating a file offset to a block is a binary search instead of a walk
+ * along the block table from the first block. The index only ever grows by
+ * following the chain from the last block it knows about, which makes it
+ * naturally pick up appended blocks; anything that rewires a chain in any
+ * other way must call lxfsChainInvalidate().
+ */
+
+/* lxfsChainIndex(): returns the chain index of an open file
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * params: file - block holding the file's metadata header
+ * params: first - first data block of the file
+ * returns: pointer to the chain index, NULL on fail
+ */
+
+ChainIndex *lxfsChainIndex(Mountpoint *mp, uint64_t id, uint64_t file, uint64_t first) {
+    ChainIndex **bucket = &mp->chains[id % CHAIN_BUCKETS];
+    ChainIndex *index = *bucket;
+    while(index) {
+        if(index->id == id) break;
+        index = index->next;
+    }
+
+    if(!index) {
+        index = calloc(1, sizeof(ChainIndex));
+        if(!index) return NULL;
+
+        index->id = id;
+        index->next = *bucket;
+        *bucket = index;
+    }
+
+    // the same ID may be reused for a different file, or the file may have
+    // been given an entirely new chain since the index was built
+    if((index->file != file) || (index->first != first)) {
+        index->file = file;
+        index->first = first;
+        index->count = 0;
+        index->mapped = 0;
+        index->expected = 0;
+        index->window = 0;
+        index->ahead = 0;
+    }
+
+    return index;
+}
+
+/* lxfsChainExtend(): appends a physical block to a chain index
+ * params: index - chain index
+ * params: block - physical block of the next logical block
+ * returns: zero on success
+ */
+
+static int lxfsChainExtend(ChainIndex *index, uint64_t block) {
+    if(index->count) {
+        Extent *last = &index->extents[index->count-1];
+        if(block == (last->physical + last->length)) {
+            // physically contiguous with the previous run
+            last->length++;
+            index->mapped++;
+            return 0;
+        }
+    }
+
+    if(index->count >= index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 8;
+        Extent *extents = realloc(index->extents, capacity * sizeof(Extent));
+        if(!extents) return 1;
+
+        index->extents = extents;
+        index->capacity = capacity;
+    }
+
+    index->extents[index->count].logical = index->mapped;
+    index->extents[index->count].physical = block;
+    index->extents[index->count].length = 1;
+    index->count++;
+    index->mapped++;
+    return 0;
+}
+
+/* lxfsChainLookup(): translates a logical block of a file to a physical block
+ * params: mp - mountpoint
+ * params: index - chain index of the file
+ * params: logical - zero-based logical block number within the file data
+ * returns: physical block number, zero if the file is not that large
+ */
+
+uint64_t lxfsChainLookup(Mountpoint *mp, ChainIndex *index, uint64_t logical) {
+    if(!index->first || (index->first == LXFS_BLOCK_EOF)) return 0;
+
+    // extend the index lazily until it covers the requested block
+    if(!index->mapped && lxfsChainExtend(index, index->first)) return 0;
+
+    while(logical >= index->mapped) {
+        if(index->mapped >= mp->volumeSize) return 0;   // corrupt chain
+
+        Extent *last = &index->extents[index->count-1];
+        uint64_t next = lxfsNextBlock(mp, last->physical + last->length - 1);
+        if(!next || (next == LXFS_BLOCK_EOF)) return 0;
+        if(lxfsChainExtend(index, next)) return 0;
+    }
+
+    // and binary search for the extent containing the block
+    size_t low = 0, high = index->count;
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        Extent *extent = &index->extents[mid];
+        if(logical < extent->logical) high = mid;
+        else if(logical >= (extent->logical + extent->length)) low = mid + 1;
+        else return extent->physical + (logical - extent->logical);
+    }
+
+    return 0;
+}
+
+/* lxfsChainRelease(): releases the chain index of a closed file
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * returns: nothing
+ */
+
+void lxfsChainRelease(Mountpoint *mp, uint64_t id) {
+    ChainIndex **ptr = &mp->chains[id % CHAIN_BUCKETS];
+    while(*ptr) {
+        ChainIndex *index = *ptr;
+        if(index->id == id) {
+            *ptr = index->next;
+            free(index->extents);
+            free(index);
+            return;
+        }
+
+        ptr = &index->next;
+    }
+}
+
+/* lxfsChainInvalidate(): discards all chain indexes built for a file
+ * params: mp - mountpoint
+ * params: file - block holding the file's metadata header
+ * returns: nothing
+ */
+
+void lxfsChainInvalidate(Mountpoint *mp, uint64_t file) {
+    for(int i = 0; i < CHAIN_BUCKETS; i++) {
+        for(ChainIndex *index = mp->chains[i]; index; index = index->next) {
+            if(index->file == file) {
+                index->count = 0;
+                index->mapped = 0;
+                index->ahead = 0;
+            }
+        }
+    }
+}
+
+/* lxfsReadahead(): reads ahead of a sequential reader of an open file
+ * params: mp - mountpoint
+ * params: index - chain index of the open file
+ * params: first - first logical block the reader just read
+ * params: last - last logical block the reader just read
+ * returns: nothing
+ */
+
+void lxfsReadahead(Mountpoint *mp, ChainIndex *index, uint64_t first, uint64_t last) {
+    if(!mp->readahead) return;
+
+    // a read is sequential if it starts where the last one ended, or in the
+    // same block if the last one ended part of the way through it
+    int sequential = (first == index->expected) || ((first + 1) == index->expected);
+    index->expected = last + 1;
+
+    if(!sequential) {
+        // collapse the window on random access
+        index->window = 0;
+        index->ahead = 0;
+        return;
+    }
+
+    // and grow it for as long as the access pattern stays sequential
+    if(!index->window) index->window = READAHEAD_MIN;
+    else index->window *= 2;
+    if(index->window > mp->readahead) index->window = mp->readahead;
+
+    // keep the next window's worth of blocks in the cache
+    uint64_t logical = (index->ahead > (last + 1)) ? index->ahead : (last + 1);
+    uint64_t end = last + 1 + index->window;
+
+    while(logical < end) {
+        uint64_t start = lxfsChainLookup(mp, index, logical);
+        if(!start) break;   // end of file
+
+        // prefetch physically contiguous runs in a single request
+        uint64_t length = 1;
+        while(((logical + length) < end) && (lxfsChainLookup(mp, index, logical + length) == (start + length)))
+            length++;
+
+        if(lxfsPrefetchBlocks(mp, start, length)) break;
+        logical += length;
+    }
+
+    index->ahead = logical;
+}
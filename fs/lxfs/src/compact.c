@@ -0,0 +1,362 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Unlinking a file leaves its directory entry behind, flagged as deleted and
+ * keeping its size so the entries that follow it can still be found. Deleted
+ * entries that this driver made are remembered per directory, so that a
+ * create can take over the smallest one that is large enough without
+ * scanning the directory, splitting off whatever it doesn't need as a
+ * smaller deleted entry. Creates in directories with no remembered entries
+ * take over the first large enough deleted entry they pass on their way to
+ * the end of the directory.
+ *
+ * Directories where deleted entries pile up faster than they are reused are
+ * compacted in the background, rewriting the entries still in use densely
+ * over the start of the directory's own chain and freeing the blocks that
+ * are left over. This moves entries, so every cached location of an entry
+ * in the directory is forgotten, and listings in progress start over from
+ * wherever their position now falls.
+ */
+
+/* smallest entry a deleted entry can be split into */
+#define SLOT_MIN        (sizeof(LXFSDirectoryEntry) - 511)
+
+/* compareBlocks(): comparison function for sorting block numbers */
+
+static int compareBlocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* lxfsSlotsFind(): returns the deleted entries remembered for a directory
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: create - non-zero to start remembering them if this isn't yet
+ * returns: pointer to the record of the directory, NULL if there is none
+ */
+
+static DirSlots *lxfsSlotsFind(Mountpoint *mp, uint64_t dir, int create) {
+    DirSlots *slots = NULL;
+    for(int i = 0; i < SLOT_DIRS; i++) {
+        if(mp->dirSlots[i].dir == dir) {
+            slots = &mp->dirSlots[i];
+            break;
+        }
+    }
+
+    if(!slots) {
+        if(!create) return NULL;
+
+        // replace the least recently used directory
+        slots = &mp->dirSlots[0];
+        for(int i = 0; i < SLOT_DIRS; i++) {
+            if(!mp->dirSlots[i].dir) {
+                slots = &mp->dirSlots[i];
+                break;
+            }
+
+            if(mp->dirSlots[i].lastUsed < slots->lastUsed) slots = &mp->dirSlots[i];
+        }
+
+        memset(slots, 0, sizeof(DirSlots));
+        slots->dir = dir;
+    }
+
+    slots->lastUsed = ++mp->slotTick;
+    return slots;
+}
+
+/* lxfsSlotsDrop(): forgets the deleted entries of a directory
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * returns: nothing
+ */
+
+void lxfsSlotsDrop(Mountpoint *mp, uint64_t dir) {
+    DirSlots *slots = lxfsSlotsFind(mp, dir, 0);
+    if(slots) memset(slots, 0, sizeof(DirSlots));
+}
+
+/* lxfsSlotRelease(): remembers a directory entry that was just deleted
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: block - block containing the deleted entry
+ * params: offset - offset of the entry within the block
+ * params: size - size of the entry
+ * params: dirBytes - size of the directory
+ * returns: nothing
+ */
+
+void lxfsSlotRelease(Mountpoint *mp, uint64_t dir, uint64_t block, off_t offset,
+                     uint16_t size, uint64_t dirBytes) {
+    DirSlots *slots = lxfsSlotsFind(mp, dir, 1);
+
+    if(slots->count < DIR_SLOTS) {
+        slots->slots[slots->count].block = block;
+        slots->slots[slots->count].offset = offset;
+        slots->slots[slots->count].size = size;
+        slots->count++;
+    }
+
+    slots->deleted++;
+    slots->deletedBytes += size;
+    if((slots->deleted >= COMPACT_MIN) && ((slots->deletedBytes * 2) >= dirBytes))
+        slots->compact = 1;
+}
+
+/* lxfsSlotFill(): writes a new directory entry over a deleted one
+ * params: mp - mountpoint
+ * params: block - block containing the deleted entry
+ * params: offset - offset of the entry within the block
+ * params: size - size of the deleted entry, at least that of the new one
+ * params: dest - new entry
+ * returns: zero on success, negative errno error code on fail
+ */
+
+int lxfsSlotFill(Mountpoint *mp, uint64_t block, off_t offset, uint16_t size,
+                 const LXFSDirectoryEntry *dest) {
+    LXFSDirectoryEntry entry;
+    memset(&entry, 0, sizeof(LXFSDirectoryEntry));
+    memcpy(&entry, dest, dest->entrySize);
+
+    // split off what isn't needed if it is large enough to be an entry,
+    // otherwise the new entry takes up all of the space
+    uint16_t rest = size - dest->entrySize;
+    if(rest >= SLOT_MIN) {
+        LXFSDirectoryEntry deleted;
+        memset(&deleted, 0, sizeof(LXFSDirectoryEntry));
+        deleted.flags = LXFS_DIR_DELETED;
+        deleted.entrySize = rest;
+        if(lxfsWritePartial(mp, 0, block, offset + dest->entrySize, &deleted, rest))
+            return -EIO;
+    } else {
+        entry.entrySize = size;
+    }
+
+    if(lxfsWritePartial(mp, 0, block, offset, &entry, entry.entrySize)) return -EIO;
+
+    lxfsFlushBlock(mp, block);
+    if((offset + size) > mp->blockSizeBytes) lxfsFlushBlock(mp, lxfsNextBlock(mp, block));
+    return 0;
+}
+
+/* lxfsSlotReuse(): writes a new directory entry over a remembered deleted one
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: dest - new entry
+ * returns: zero on success, negative errno error code on fail, positive if
+ * no remembered deleted entry is large enough
+ */
+
+int lxfsSlotReuse(Mountpoint *mp, uint64_t dir, const LXFSDirectoryEntry *dest) {
+    DirSlots *slots = lxfsSlotsFind(mp, dir, 0);
+    if(!slots) return 1;
+
+    for(;;) {
+        // take the smallest one that fits
+        int best = -1;
+        for(int i = 0; i < slots->count; i++) {
+            if((slots->slots[i].size >= dest->entrySize)
+            && ((best < 0) || (slots->slots[i].size < slots->slots[best].size)))
+                best = i;
+        }
+
+        if(best < 0) return 1;
+
+        FreeSlot slot = slots->slots[best];
+        slots->slots[best] = slots->slots[--slots->count];
+
+        // make sure nothing else has been written there since
+        LXFSDirectoryEntry *entry = lxfsEntryAt(mp, slot.block, slot.offset);
+        if(!entry) return -EIO;
+        if((entry->flags & LXFS_DIR_VALID) || (entry->entrySize != slot.size)) continue;
+
+        int status = lxfsSlotFill(mp, slot.block, slot.offset, slot.size, dest);
+        if(status) return status;
+
+        mp->reusedSlots++;
+
+        // and keep whatever was split off for the next create
+        uint16_t rest = slot.size - dest->entrySize;
+        uint16_t used = dest->entrySize;
+        if(rest < SLOT_MIN) {
+            if(slots->deleted) slots->deleted--;
+            used = slot.size;
+        } else {
+            slot.offset += dest->entrySize;
+            slot.size = rest;
+            if(slot.offset >= mp->blockSizeBytes) {
+                slot.block = lxfsNextBlock(mp, slot.block);
+                slot.offset -= mp->blockSizeBytes;
+            }
+
+            if(slot.block && (slot.block != LXFS_BLOCK_EOF))
+                slots->slots[slots->count++] = slot;
+        }
+
+        if(slots->deletedBytes >= used) slots->deletedBytes -= used;
+        else slots->deletedBytes = 0;
+        return 0;
+    }
+}
+
+/* lxfsCompact(): rewrites a directory without its deleted entries
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * returns: zero on success
+ */
+
+int lxfsCompact(Mountpoint *mp, uint64_t dir) {
+    // find every block of the directory, which the compacted entries are
+    // written back over
+    size_t count = 0, capacity = 16;
+    uint64_t *blocks = malloc(capacity * sizeof(uint64_t));
+    if(!blocks) return 1;
+
+    uint64_t block = dir;
+    while(block != LXFS_BLOCK_EOF) {
+        if(!block || (count >= mp->volumeSize)) {
+            free(blocks);
+            return 1;
+        }
+
+        if(count >= capacity) {
+            capacity *= 2;
+            uint64_t *newBlocks = realloc(blocks, capacity * sizeof(uint64_t));
+            if(!newBlocks) {
+                free(blocks);
+                return 1;
+            }
+
+            blocks = newBlocks;
+        }
+
+        blocks[count++] = block;
+        block = lxfsNextBlock(mp, block);
+    }
+
+    uint8_t *data = malloc(count * mp->blockSizeBytes);
+    if(!data) {
+        free(blocks);
+        return 1;
+    }
+
+    // absorbed appends remember where the entries of their files are
+    if(lxfsAppendCommitAll(mp, 0)) {
+        free(data);
+        free(blocks);
+        return 1;
+    }
+
+    // the hash index refers to entries by where they are
+    lxfsIndexDrop(mp, dir);
+
+    if(lxfsReadBlock(mp, dir, data)) {
+        free(data);
+        free(blocks);
+        return 1;
+    }
+
+    // keep the header as it is, followed by the entries still in use
+    size_t size = sizeof(LXFSDirectoryHeader);
+    uint64_t entries = 0, deleted = 0;
+
+    DirPosition pos;
+    pos.block = dir;
+    pos.offset = sizeof(LXFSDirectoryHeader);
+    pos.index = 0;
+    pos.loaded = 0;
+
+    LXFSDirectoryEntry *entry;
+    while((entry = lxfsReadEntry(mp, &pos))) {
+        if(!(entry->flags & LXFS_DIR_VALID)) {
+            deleted++;
+            continue;
+        }
+
+        if((size + entry->entrySize) > (count * mp->blockSizeBytes)) {
+            pos.block = 0;  // treat a corrupt directory like an I/O error
+            break;
+        }
+
+        memcpy(data + size, entry, entry->entrySize);
+        size += entry->entrySize;
+        entries++;
+    }
+
+    if(!pos.block || !deleted) {
+        free(data);
+        free(blocks);
+        lxfsSlotsDrop(mp, dir);
+        return !pos.block;
+    }
+
+    LXFSDirectoryHeader *header = (LXFSDirectoryHeader *) data;
+    header->sizeEntries = entries;
+    header->sizeBytes = size;
+    header->index = 0;
+    memset(data + size, 0, (count * mp->blockSizeBytes) - size);
+
+    size_t used = (size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    for(size_t i = 0; i < used; i++) {
+        if(lxfsWriteBlock(mp, blocks[i], data + (i * mp->blockSizeBytes))) {
+            free(data);
+            free(blocks);
+            return 1;
+        }
+    }
+
+    free(data);
+
+    // and free the blocks that are no longer needed
+    if(used < count) {
+        if(lxfsSetNextBlock(mp, blocks[used-1], LXFS_BLOCK_EOF) || lxfsFreeChain(mp, blocks[used])) {
+            free(blocks);
+            return 1;
+        }
+    }
+
+    lxfsFlushMetadata(mp);
+
+    // every cached location of an entry in the directory is now wrong
+    lxfsReaddirInvalidate(mp, dir);
+    lxfsDentryInvalidateDir(mp, dir);
+    qsort(blocks, count, sizeof(uint64_t), compareBlocks);
+    lxfsHandleInvalidateDir(mp, blocks, count);
+    lxfsSlotsDrop(mp, dir);
+    free(blocks);
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: compacted directory at block %d, removed %d deleted entries and freed %d blocks\n",
+        mp->device, dir, deleted, count - used);
+
+    if((mp->features & LXFS_FEATURE_DIR_INDEX) && (entries >= INDEX_THRESHOLD))
+        lxfsIndexBuild(mp, dir, 0);
+    return 0;
+}
+
+/* lxfsCompactPending(): compacts the directories that are due for it
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+void lxfsCompactPending(Mountpoint *mp) {
+    for(int i = 0; i < SLOT_DIRS; i++) {
+        DirSlots *slots = &mp->dirSlots[i];
+        if(!slots->dir || !slots->compact) continue;
+
+        // don't retry a directory that failed until more is deleted from it
+        slots->compact = 0;
+        if(lxfsCompact(mp, slots->dir))
+            luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to compact directory at block %d\n", mp->device, slots->dir);
+    }
+}
@@ -0,0 +1,221 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/* copy_file_range() between two files on the same volume runs entirely in
+ * the driver instead of passing every byte through the client. The source is
+ * read COPY_BLOCKS blocks at a time, with physically contiguous runs of its
+ * chain read in single device requests and partial blocks taken from the
+ * cache, and each piece goes through the same path as a write. Pieces are
+ * cut so that all but the first start on a block boundary in the destination,
+ * so their whole blocks are streamed to the device in contiguous runs.
+ */
+
+/* lxfsCopyFind(): finds a regular file taking part in a copy
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * params: path - path of the file
+ * params: file - pointer to store the block holding the file header
+ * returns: zero on success, negative errno error code on fail
+ */
+
+static int lxfsCopyFind(Mountpoint *mp, uint64_t id, const char *path, uint64_t *file) {
+    Handle *handle = lxfsHandleGet(mp, id, path);
+    if(handle) {
+        *file = handle->file;
+        return 0;
+    }
+
+    LXFSDirectoryEntry entry;
+    if(!lxfsFind(&entry, mp, path, NULL, NULL)) return -ENOENT;
+
+    uint8_t type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+    if(type == LXFS_DIR_TYPE_DIR) return -EISDIR;
+    if(type != LXFS_DIR_TYPE_FILE) return -EINVAL;
+
+    *file = entry.block;
+    return 0;
+}
+
+/* lxfsCopyRead(): reads a piece of the source of a copy
+ * params: mp - mountpoint
+ * params: block - block to read from, updated as the read goes on
+ * params: offset - offset within the block, updated as the read goes on
+ * params: length - number of bytes to read
+ * params: buffer - buffer to read into
+ * returns: number of bytes read
+ */
+
+static size_t lxfsCopyRead(Mountpoint *mp, uint64_t *block, off_t *offset, size_t length, void *buffer) {
+    size_t done = 0;
+    while((done < length) && *block && (*block != LXFS_BLOCK_EOF)) {
+        // whole blocks are read in runs
+        if(!*offset && ((length - done) >= mp->blockSizeBytes)) {
+            uint64_t count = lxfsReadChain(mp, block, (length - done) / mp->blockSizeBytes, buffer + done);
+            if(!count) break;
+
+            done += count * mp->blockSizeBytes;
+            continue;
+        }
+
+        // and partial ones are copied from the cache
+        size_t part = mp->blockSizeBytes - *offset;
+        if(part > (length - done)) part = length - done;
+
+        if(lxfsIsUnwritten(mp, *block)) {
+            memset(buffer + done, 0, part);
+        } else {
+            Cache *slot = lxfsBorrowBlock(mp, *block);
+            if(!slot) break;
+
+            memcpy(buffer + done, slot->data + *offset, part);
+            lxfsReturnBlock(slot);
+        }
+
+        done += part;
+        *offset += part;
+        if(*offset == mp->blockSizeBytes) {
+            *offset = 0;
+            *block = lxfsNextBlock(mp, *block);
+        }
+    }
+
+    return done;
+}
+
+/* lxfsCopyRange(): implementation of copy_file_range() for lxfs
+ * params: cmd - copy range command message
+ * returns: nothing, response relayed to kernel
+ */
+
+void lxfsCopyRange(CopyRangeCommand *cmd) {
+    cmd->header.header.response = 1;
+    cmd->header.header.length = sizeof(CopyRangeCommand);
+
+    Mountpoint *mp = findMP(cmd->device);
+    if(!mp) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    if((cmd->srcPosition < 0) || (cmd->destPosition < 0)) {
+        cmd->header.header.status = -EINVAL;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    uint64_t src, dest;
+    int status = lxfsCopyFind(mp, cmd->srcId, cmd->srcPath, &src);
+    if(!status) status = lxfsCopyFind(mp, cmd->destId, cmd->destPath, &dest);
+    if(status) {
+        cmd->header.header.status = status;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    Cache *slot = lxfsBorrowBlock(mp, src);
+    if(!slot) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    uint64_t size = ((LXFSFileHeader *) slot->data)->size;
+    lxfsReturnBlock(slot);
+
+    uint64_t first = lxfsNextBlock(mp, src);
+    if(!first) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // copies stop at the end of the source
+    size_t length = cmd->length;
+    if(cmd->srcPosition >= size) length = 0;
+    else if((cmd->srcPosition + length) > size) length = size - cmd->srcPosition;
+
+    if(!length) {
+        cmd->length = 0;
+        cmd->header.header.status = 0;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // and can't overlap themselves within a file
+    if((src == dest) && (cmd->srcPosition < (cmd->destPosition + length))
+    && (cmd->destPosition < (cmd->srcPosition + length))) {
+        cmd->header.header.status = -EINVAL;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    RWCommand *wcmd = malloc(sizeof(RWCommand) + (COPY_BLOCKS * mp->blockSizeBytes));
+    if(!wcmd) {
+        cmd->header.header.status = -ENOMEM;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    memset(wcmd, 0, sizeof(RWCommand));
+    wcmd->header.header.command = COMMAND_WRITE;
+    strcpy(wcmd->path, cmd->destPath);
+    strcpy(wcmd->device, cmd->device);
+    wcmd->id = cmd->destId;
+    wcmd->uid = cmd->uid;
+    wcmd->gid = cmd->gid;
+
+    uint64_t block;
+    off_t offset = cmd->srcPosition % mp->blockSizeBytes;
+    if(LXFS_INLINE(first, size)) {
+        block = 0;
+    } else {
+        ChainIndex *index = lxfsChainIndex(mp, cmd->srcId, src, first);
+        if(index) block = lxfsChainLookup(mp, index, cmd->srcPosition / mp->blockSizeBytes);
+        else block = lxfsGetBlock(mp, first, cmd->srcPosition);
+    }
+
+    size_t copied = 0;
+    while(copied < length) {
+        // every piece after the first starts on a block boundary in the
+        // destination
+        size_t chunk = (COPY_BLOCKS * mp->blockSizeBytes) - ((cmd->destPosition + copied) % mp->blockSizeBytes);
+        if(chunk > (length - copied)) chunk = length - copied;
+
+        if(LXFS_INLINE(first, size)) {
+            if(lxfsInlineRead(mp, src, cmd->srcPosition + copied, chunk, wcmd->data)) {
+                status = -EIO;
+                break;
+            }
+        } else if(lxfsCopyRead(mp, &block, &offset, chunk, wcmd->data) != chunk) {
+            status = -EIO;
+            break;
+        }
+
+        wcmd->position = cmd->destPosition + copied;
+        wcmd->length = chunk;
+        status = lxfsWriteData(wcmd);
+        if(status < 0) break;
+
+        copied += chunk;
+    }
+
+    free(wcmd);
+
+    // like a write, a copy cut short reports what it did copy
+    cmd->srcPosition += copied;
+    cmd->destPosition += copied;
+    cmd->length = copied;
+    cmd->header.header.status = copied ? copied : status;
+    luxSendKernel(cmd);
+}
@@ -14,6 +14,82 @@
 #include <errno.h>
 #include <time.h>
 
+/* lxfsCreateFinish(): updates the parent directory after an entry was added
+ * params: mp - mountpoint
+ * params: dir - first block of the parent directory
+ * params: bytes - number of bytes the directory grew by
+ * params: timestamp - time of creation
+ * returns: nothing
+ */
+
+static void lxfsCreateFinish(Mountpoint *mp, uint64_t dir, uint16_t bytes, time_t timestamp) {
+    // TODO: is there a better way to handle errors here?
+    // I'd argue this is a forgiveable error for lack of a better word
+    // and the POSIX spec doesn't cover this afaik
+    if(lxfsReadBlock(mp, dir, mp->dataBuffer))
+        return;
+
+    LXFSDirectoryHeader *parentHeader = (LXFSDirectoryHeader *) mp->dataBuffer;
+    parentHeader->sizeBytes += bytes;
+    parentHeader->sizeEntries++;
+    parentHeader->accessTime = timestamp;
+    parentHeader->modTime = timestamp;
+    lxfsWriteBlock(mp, dir, mp->dataBuffer);
+    lxfsFlushBlock(mp, dir);
+
+    // large directories get a hash index, which is also how an index that
+    // was dropped for being out of date or too full is rebuilt
+    if((mp->features & LXFS_FEATURE_DIR_INDEX) && !parentHeader->index
+    && (parentHeader->sizeEntries >= INDEX_THRESHOLD))
+        lxfsIndexBuild(mp, dir, 0);
+}
+
+/* lxfsAppendEntry(): writes a new entry at the end of a directory
+ * params: mp - mountpoint
+ * params: block - block containing the end of the directory
+ * params: offset - offset of the end within the block, which may be just past
+ * the end of the block if the last entry ends with it
+ * params: dest - entry to write
+ * returns: zero on success, negative errno error code on fail
+ */
+
+int lxfsAppendEntry(Mountpoint *mp, uint64_t block, off_t offset, const LXFSDirectoryEntry *dest) {
+    uint64_t next = lxfsNextBlock(mp, block);
+    if(!next) return -EIO;
+
+    // grow the directory by one block if the entry doesn't fit
+    if(((offset + dest->entrySize) > mp->blockSizeBytes) && (next == LXFS_BLOCK_EOF)) {
+        next = lxfsAllocate(mp, 1, block, 0);
+        if(!next) return -ENOSPC;
+
+        memset(mp->dataBuffer, 0, mp->blockSizeBytes);
+        if(lxfsWriteBlock(mp, next, mp->dataBuffer)) {
+            lxfsSetNextBlock(mp, next, LXFS_BLOCK_FREE);
+            return -EIO;
+        }
+
+        if(lxfsSetNextBlock(mp, block, next)) {
+            lxfsSetNextBlock(mp, next, LXFS_BLOCK_FREE);
+            return -EIO;
+        }
+
+        // the new block must be on the disk before the directory links to it
+        lxfsFlushBlock(mp, next);
+        lxfsFlushTableEntry(mp, next);
+        lxfsFlushTableEntry(mp, block);
+    }
+
+    if(offset >= mp->blockSizeBytes) {
+        block = next;
+        offset -= mp->blockSizeBytes;
+    }
+
+    if(lxfsWritePartial(mp, 0, block, offset, dest, dest->entrySize)) return -EIO;
+    lxfsFlushBlock(mp, block);
+    if((offset + dest->entrySize) > mp->blockSizeBytes) lxfsFlushBlock(mp, lxfsNextBlock(mp, block));
+    return 0;
+}
+
 /* lxfsCreate(): creates a file or directory on the lxfs volume
  * params: dest - destination buffer to store directory entry
  * non-zero block in the dest structure indicates hard link creation
@@ -38,6 +114,9 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
         va_end(args);
     }
 
+    // forget anything cached about this path, most notably that it didn't exist
+    lxfsDentryInvalidate(mp, path);
+
     // get the parent directory
     LXFSDirectoryEntry parent;
     int depth = pathDepth(path);
@@ -105,12 +184,12 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
     dest->modTime = timestamp;
 
     memset(dest->reserved, 0, sizeof(dest->reserved));
+    dest->nameHash = lxfsNameHash((const char *) dest->name);
 
     if(!hardLink) {
-        dest->block = lxfsFindFreeBlock(mp, 0);
+        // keep the file close to its parent directory
+        dest->block = lxfsAllocate(mp, 1, parent.block, 0);
         if(!dest->block) return -ENOSPC;
-        if(lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_EOF))
-            return -EIO;
 
         memset(mp->dataBuffer, 0, mp->blockSizeBytes);
         
@@ -127,7 +206,7 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
             dirHeader->accessTime = timestamp;
             dirHeader->createTime = timestamp;
             dirHeader->modTime = timestamp;
-            dirHeader->reserved = 0;
+            dirHeader->index = 0;
             dirHeader->sizeBytes = sizeof(LXFSDirectoryHeader);
             dirHeader->sizeEntries = 0;
             if(lxfsWriteBlock(mp, dest->block, mp->dataBuffer)) {
@@ -149,84 +228,80 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
         fileHeader->refCount++;
         dest->size = fileHeader->size;
         if(lxfsWriteBlock(mp, dest->block, mp->dataBuffer)) return -EIO;
+
+        // open handles on the file hold a copy of the old count
+        lxfsHandleInvalidate(mp, dest->block);
     }
 
+    // the new chain must reach the disk before any entry that points to it
     lxfsFlushBlock(mp, dest->block);
-    uint64_t block = parent.block;
-    uint64_t prevBlock;
+    lxfsFlushTableEntry(mp, dest->block);
+    lxfsReaddirInvalidate(mp, parent.block);
 
-    LXFSDirectoryHeader *parentHeader = (LXFSDirectoryHeader *) mp->dataBuffer;
-    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t) mp->dataBuffer + sizeof(LXFSDirectoryHeader));
+    // indexed directories have their end recorded in the index, so the new
+    // entry is appended there without scanning for free space
+    int status = lxfsIndexAppend(mp, parent.block, dest);
+    if(!status) {
+        lxfsCreateFinish(mp, parent.block, dest->entrySize, timestamp);
+        return 0;
+    }
+
+    // other directories reuse the space of an entry deleted earlier
+    if(status > 0) status = lxfsSlotReuse(mp, parent.block, dest);
+    if(!status) {
+        lxfsCreateFinish(mp, parent.block, 0, timestamp);
+        return 0;
+    } else if(status < 0) {
+        if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+        return status;
+    }
+
+    // or otherwise the first large enough deleted entry or the end of the
+    // directory, whichever comes first
+    uint64_t block = parent.block;
+    uint64_t next;
     off_t offset = sizeof(LXFSDirectoryHeader);
+    LXFSDirectoryEntry *dir;
 
     for(;;) {
-        prevBlock = block;
-        block = lxfsReadNextBlock(mp, block, mp->dataBuffer);
-        if(!block) return -EIO;
+        next = lxfsReadNextBlock(mp, block, mp->dataBuffer);
+        if(!next) status = -EIO;
+        else if(next == LXFS_BLOCK_EOF) memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+        else if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) status = -EIO;
 
-        if(block != LXFS_BLOCK_EOF)
-            lxfsReadBlock(mp, block, mp->dataBuffer + mp->blockSizeBytes);
-        
+        if(status < 0) {
+            if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+            return status;
+        }
+
+        dir = (LXFSDirectoryEntry *)((uintptr_t) mp->dataBuffer + offset);
         while(offset < mp->blockSizeBytes) {
-            if(!dir->flags & LXFS_DIR_VALID && (!dir->entrySize || (dir->entrySize >= dest->entrySize)))
-                break;
+            if(!dir->entrySize) break;
+            if(!(dir->flags & LXFS_DIR_VALID) && (dir->entrySize >= dest->entrySize)) break;
             offset += dir->entrySize;
             dir = (LXFSDirectoryEntry *)((uintptr_t) dir + dir->entrySize);
         }
 
-        if(!dir->flags & LXFS_DIR_VALID && (!dir->entrySize || (dir->entrySize >= dest->entrySize))) {
-            if(offset + dest->entrySize <= mp->blockSizeBytes) {
-                // directory entry doesn't cross block boundary
-                memcpy(dir, dest, dest->entrySize);
-                if(lxfsWriteBlock(mp, prevBlock, mp->dataBuffer)) {
-                    if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
-                    return -EIO;
-                }
-                lxfsFlushBlock(mp, prevBlock);
-            } else {
-                // free entry but it crosses a block boundary, so allocate one more block
-                block = lxfsFindFreeBlock(mp, 0);
-                if(!block) return -ENOSPC;
-                if(lxfsSetNextBlock(mp, prevBlock, block)) return -EIO;
-                if(lxfsSetNextBlock(mp, block, LXFS_BLOCK_EOF)) {
-                    lxfsSetNextBlock(mp, prevBlock, LXFS_BLOCK_EOF);
-                    return -EIO;
-                }
-
-                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
-                memcpy(dir, dest, dest->entrySize);
-                if(lxfsWriteBlock(mp, prevBlock, mp->dataBuffer))
-                    return -EIO;
-                if(lxfsWriteBlock(mp, block, mp->dataBuffer + mp->blockSizeBytes))
-                    return -EIO;
-                
-                lxfsFlushBlock(mp, prevBlock);
-                lxfsFlushBlock(mp, block);
-            }
+        if((offset < mp->blockSizeBytes) || (next == LXFS_BLOCK_EOF)) break;
 
-            // TODO: is there a better way to handle errors here?
-            // I'd argue this is a forgiveable error for lack of a better word
-            // and the POSIX spec doesn't cover this afaik
-            if(lxfsReadBlock(mp, parent.block, mp->dataBuffer))
-                return 0;
-
-            parentHeader->sizeBytes += dest->entrySize;
-            parentHeader->sizeEntries++;
-            parentHeader->accessTime = timestamp;
-            parentHeader->modTime = timestamp;
-            lxfsWriteBlock(mp, parent.block, mp->dataBuffer);
-            lxfsFlushBlock(mp, parent.block);
-            return 0;
-        }
+        // entries may continue into the next block
+        block = next;
+        offset -= mp->blockSizeBytes;
+    }
 
-        if(block == LXFS_BLOCK_EOF) {
-            // TODO:
-            // reached last block without finding a free entry, allocate a new block here too
-            luxLogf(KPRINT_LEVEL_ERROR, "TODO: %s: %d\n", __FILE__, __LINE__);
-            return -ENOSYS;
-        }
+    uint16_t bytes = 0;
+    if((offset < mp->blockSizeBytes) && dir->entrySize) {
+        status = lxfsSlotFill(mp, block, offset, dir->entrySize, dest);
+    } else {
+        status = lxfsAppendEntry(mp, block, offset, dest);
+        bytes = dest->entrySize;
+    }
 
-        memcpy(mp->dataBuffer + mp->blockSizeBytes, mp->dataBuffer, mp->blockSizeBytes);
-        offset -= mp->blockSizeBytes;
+    if(status) {
+        if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+        return status;
     }
+
+    lxfsCreateFinish(mp, parent.block, bytes, timestamp);
+    return 0;
 }
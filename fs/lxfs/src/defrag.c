@@ -0,0 +1,282 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Files that grow a little at a time on a long-lived volume end up scattered
+ * over many short runs of blocks, and reading them back costs one device
+ * request per run. With the defrag mount option, the driver walks the whole
+ * directory tree every DEFRAG_INTERVAL seconds, a few entries at a time when
+ * it has nothing else to do, and moves the data of every fragmented file it
+ * finds into a single contiguous run of free blocks. The header block of the
+ * file and its directory entry stay where they are, so the file keeps its
+ * inode number, which is its header block, and the move only takes a single
+ * block table entry, the link from the header to the first data block, to
+ * switch over from the old chain to the new one. Until then the old chain is
+ * untouched, and the new one is written and flushed first, so an interrupted
+ * move leaves either of them in place and leaks no blocks other than the new
+ * run. Files that are open, that still have unwritten blocks or that are too
+ * large to copy quickly are left alone.
+ */
+
+/* lxfsDefragFile(): moves the data of a file into a contiguous run of blocks
+ * if it is fragmented
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * returns: number of blocks moved, zero if the file was left alone, negative
+ * on fail
+ */
+
+static int64_t lxfsDefragFile(Mountpoint *mp, uint64_t file) {
+    if(lxfsHandleIsOpen(mp, file)) return 0;
+
+    uint64_t first = lxfsNextBlock(mp, file);
+    if(!first) return -1;
+    if(first == LXFS_BLOCK_EOF) return 0;   // empty or inline
+
+    // collect the chain, giving up on files we won't move anyway
+    size_t count = 0, capacity = 64;
+    uint64_t *blocks = malloc(capacity * sizeof(uint64_t));
+    if(!blocks) return -1;
+
+    uint64_t extents = 1;
+    for(uint64_t block = first; block != LXFS_BLOCK_EOF; block = lxfsNextBlock(mp, block)) {
+        if(!block) {
+            free(blocks);
+            return -1;
+        }
+
+        if((count >= DEFRAG_MAX) || lxfsIsUnwritten(mp, block)) {
+            free(blocks);
+            return 0;
+        }
+
+        if(count == capacity) {
+            uint64_t *list = realloc(blocks, (capacity * 2) * sizeof(uint64_t));
+            if(!list) {
+                free(blocks);
+                return -1;
+            }
+
+            blocks = list;
+            capacity *= 2;
+        }
+
+        if(count && (block != (blocks[count-1] + 1))) extents++;
+        blocks[count++] = block;
+    }
+
+    if(extents == 1) {
+        free(blocks);
+        return 0;
+    }
+
+    // prefer the space right after the header, the file's own reservation
+    // included
+    lxfsReserveRelease(mp, file);
+    uint64_t run = lxfsAllocateRun(mp, count, file);
+    if(!run) {
+        free(blocks);
+        return 0;
+    }
+
+    void *buffer = malloc(COPY_BLOCKS * mp->blockSizeBytes);
+    if(!buffer) {
+        lxfsFreeChain(mp, run);
+        free(blocks);
+        return -1;
+    }
+
+    // copy one physically contiguous piece of the old chain at a time
+    size_t i = 0;
+    while(i < count) {
+        size_t length = 1;
+        while(((i + length) < count) && (length < COPY_BLOCKS)
+        && (blocks[i + length] == (blocks[i] + length)))
+            length++;
+
+        if(lxfsReadBlocksDirect(mp, blocks[i], length, buffer)
+        || lxfsStreamBlocks(mp, run + i, length, buffer)) {
+            free(buffer);
+            lxfsFreeChain(mp, run);
+            free(blocks);
+            return -1;
+        }
+
+        i += length;
+    }
+
+    free(buffer);
+
+    // the new chain must be on the disk before the header links to it
+    if(lxfsFlushMetadata(mp) || lxfsSetNextBlock(mp, file, run)) {
+        lxfsFreeChain(mp, run);
+        free(blocks);
+        return -1;
+    }
+
+    if(lxfsFlushMetadata(mp)) {
+        free(blocks);
+        return -1;
+    }
+
+    // and only then does the old chain go
+    lxfsChainInvalidate(mp, file);
+    if(lxfsFreeChain(mp, first)) {
+        luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to free the old blocks of file at block %d\n", mp->device, file);
+        free(blocks);
+        return -1;
+    }
+
+    free(blocks);
+    if(lxfsFlushMetadata(mp)) return -1;
+    return count;
+}
+
+/* lxfsDefragPush(): adds a directory to the list of those left to visit
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * returns: zero on success
+ */
+
+static int lxfsDefragPush(Mountpoint *mp, uint64_t dir) {
+    Defrag *defrag = &mp->defrag;
+    if(defrag->count == defrag->capacity) {
+        size_t capacity = defrag->capacity ? defrag->capacity * 2 : 64;
+        uint64_t *list = realloc(defrag->stack, capacity * sizeof(uint64_t));
+        if(!list) return 1;
+
+        defrag->stack = list;
+        defrag->capacity = capacity;
+    }
+
+    defrag->stack[defrag->count++] = dir;
+    return 0;
+}
+
+/* lxfsDefragFinish(): ends a defragmentation pass and reports on it
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+static void lxfsDefragFinish(Mountpoint *mp) {
+    Defrag *defrag = &mp->defrag;
+    free(defrag->stack);
+    defrag->stack = NULL;
+    defrag->count = 0;
+    defrag->capacity = 0;
+    defrag->dir = 0;
+    defrag->lastPass = time(NULL);
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: defragmentation looked at %d files, moved %d of them (%d blocks)\n",
+        mp->device, defrag->files, defrag->moved, defrag->blocks);
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: %d extents before defragmentation, %d after\n",
+        mp->device, defrag->extents, mp->fileCount + mp->fragments);
+    lxfsReportFragmentation(mp);
+}
+
+/* lxfsDefragStep(): does a little of the defragmentation pass, starting a
+ * new one when it is due
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+void lxfsDefragStep(Mountpoint *mp) {
+    Defrag *defrag = &mp->defrag;
+    if(!defrag->enabled) return;
+
+    if(!defrag->dir && !defrag->count) {
+        if(defrag->lastPass && ((time(NULL) - defrag->lastPass) < DEFRAG_INTERVAL)) return;
+        if(lxfsDefragPush(mp, mp->root)) return;
+
+        defrag->files = 0;
+        defrag->moved = 0;
+        defrag->blocks = 0;
+        defrag->extents = mp->fileCount + mp->fragments;
+
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: starting defragmentation\n", mp->device);
+        lxfsReportFragmentation(mp);
+    }
+
+    uint64_t blocks = 0, scanned = 0;
+    while((blocks < DEFRAG_BLOCKS) && (scanned < DEFRAG_SCAN)) {
+        if(!defrag->dir) {
+            if(!defrag->count) {
+                lxfsDefragFinish(mp);
+                return;
+            }
+
+            defrag->dir = defrag->stack[--defrag->count];
+            defrag->skip = 0;
+        }
+
+        // find where the last step left off in this directory
+        DirPosition pos;
+        pos.block = defrag->dir;
+        pos.offset = sizeof(LXFSDirectoryHeader);
+        pos.index = 0;
+        pos.loaded = 0;
+
+        while((pos.index < defrag->skip) && lxfsReadEntry(mp, &pos));
+
+        while((blocks < DEFRAG_BLOCKS) && (scanned < DEFRAG_SCAN)) {
+            LXFSDirectoryEntry *entry = lxfsReadEntry(mp, &pos);
+            if(!entry) {
+                if(!pos.block)
+                    luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to read directory at block %d while defragmenting\n",
+                        mp->device, defrag->dir);
+                defrag->dir = 0;
+                break;
+            }
+
+            defrag->skip++;
+            scanned++;
+            if(!(entry->flags & LXFS_DIR_VALID)) continue;
+
+            uint8_t type = (entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+            if(type == LXFS_DIR_TYPE_DIR) {
+                if(lxfsDefragPush(mp, entry->block))
+                    luxLogf(KPRINT_LEVEL_WARNING, "%s: skipping directory at block %d while defragmenting\n",
+                        mp->device, entry->block);
+            } else if(type == LXFS_DIR_TYPE_FILE) {
+                uint64_t file = entry->block;
+                int64_t moved = lxfsDefragFile(mp, file);
+                pos.loaded = 0;     // the data buffer may not have survived
+
+                defrag->files++;
+                if(moved < 0) {
+                    luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to defragment file at block %d\n", mp->device, file);
+                } else if(moved) {
+                    defrag->moved++;
+                    defrag->blocks += moved;
+                    blocks += moved;
+                }
+            }
+        }
+    }
+}
+
+/* lxfsDefragForget(): drops a deleted directory from the defragmentation pass
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * returns: nothing
+ */
+
+void lxfsDefragForget(Mountpoint *mp, uint64_t dir) {
+    Defrag *defrag = &mp->defrag;
+    if(defrag->dir == dir) defrag->dir = 0;
+
+    size_t i = 0;
+    while(i < defrag->count) {
+        if(defrag->stack[i] == dir) defrag->stack[i] = defrag->stack[--defrag->count];
+        else i++;
+    }
+}
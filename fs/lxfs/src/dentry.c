@@ -0,0 +1,244 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The dentry cache remembers the result of directory lookups, both positive
+ * and negative. Every record is keyed by a parent directory block and a name;
+ * records for individual path components use the block of the directory that
+ * was scanned, while records for full paths use a parent of zero, which can
+ * never be a directory block because block zero holds the volume identifier.
+ * Full path records also remember the directory they were found in so that
+ * invalidating a path can find its component record too, unless the lookup
+ * failed before reaching it, in which case that directory is left as zero. The
+ * table is direct mapped and a new record simply replaces whatever collided
+ * with it.
+ */
+
+/* lxfsDentryInit(): allocates the dentry cache of a mountpoint
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsDentryInit(Mountpoint *mp) {
+    mp->dentries = calloc(DENTRY_CACHE_SIZE, sizeof(Dentry));
+    if(!mp->dentries) return 1;
+    return 0;
+}
+
+/* lxfsDentryHash(): hashes a parent block and name pair
+ * params: parent - parent directory block, zero for full paths
+ * params: name - file name or full path
+ * returns: 64-bit hash
+ */
+
+static uint64_t lxfsDentryHash(uint64_t parent, const char *name) {
+    // FNV-1a
+    uint64_t hash = 0xCBF29CE484222325 ^ parent;
+    while(*name) {
+        hash ^= (uint8_t) *name;
+        hash *= 0x100000001B3;
+        name++;
+    }
+
+    return hash;
+}
+
+/* lxfsDentryProbe(): looks up a record without touching the statistics
+ * params: mp - mountpoint
+ * params: parent - parent directory block, zero for full paths
+ * params: name - file name or full path
+ * returns: pointer to the record, NULL if not cached
+ */
+
+static Dentry *lxfsDentryProbe(Mountpoint *mp, uint64_t parent, const char *name) {
+    uint64_t hash = lxfsDentryHash(parent, name);
+    Dentry *d = &mp->dentries[hash % DENTRY_CACHE_SIZE];
+
+    if(d->valid && (d->hash == hash) && (d->parent == parent) && !strcmp(d->name, name))
+        return d;
+    return NULL;
+}
+
+/* lxfsDentryLookup(): looks up a record in the dentry cache
+ * params: mp - mountpoint
+ * params: parent - parent directory block, zero for full paths
+ * params: name - file name or full path
+ * returns: pointer to the record, NULL if not cached
+ */
+
+Dentry *lxfsDentryLookup(Mountpoint *mp, uint64_t parent, const char *name) {
+    Dentry *d = lxfsDentryProbe(mp, parent, name);
+    if(d) mp->dentryHits++;
+    else mp->dentryMisses++;
+    return d;
+}
+
+/* lxfsDentryInsert(): adds a record to the dentry cache
+ * params: mp - mountpoint
+ * params: parent - parent directory block, zero for full paths
+ * params: name - file name or full path
+ * params: dir - directory block the entry was found in
+ * params: entry - directory entry, NULL for negative records
+ * params: block - block containing the start of the entry
+ * params: offset - offset of the entry within the block
+ * returns: nothing
+ */
+
+void lxfsDentryInsert(Mountpoint *mp, uint64_t parent, const char *name, uint64_t dir,
+                      const LXFSDirectoryEntry *entry, uint64_t block, off_t offset) {
+    uint64_t hash = lxfsDentryHash(parent, name);
+    Dentry *d = &mp->dentries[hash % DENTRY_CACHE_SIZE];
+
+    if(d->valid && strcmp(d->name, name)) {
+        free(d->name);
+        d->name = NULL;
+    }
+
+    if(!d->name) d->name = strdup(name);
+    if(!d->name) {
+        d->valid = 0;
+        return;
+    }
+
+    d->valid = 1;
+    d->hash = hash;
+    d->parent = parent;
+    d->dir = dir;
+    d->negative = !entry;
+    d->block = block;
+    d->offset = offset;
+    if(entry) memmove(&d->entry, entry, entry->entrySize);
+}
+
+/* lxfsDentryDrop(): removes a single record from the dentry cache
+ * params: d - record to remove
+ * returns: nothing
+ */
+
+static void lxfsDentryDrop(Dentry *d) {
+    d->valid = 0;
+    free(d->name);
+    d->name = NULL;
+}
+
+/* lxfsDentryParent(): finds the directory block a cached path lives in
+ * params: mp - mountpoint
+ * params: path - full qualified path
+ * returns: directory block, zero if it isn't known to the cache
+ */
+
+static uint64_t lxfsDentryParent(Mountpoint *mp, const char *path) {
+    Dentry *d = lxfsDentryProbe(mp, 0, path);
+    if(d && d->dir) return d->dir;
+
+    if(pathDepth(path) <= 1) return mp->root;
+
+    char *parentPath = strdup(path);
+    if(!parentPath) return 0;
+
+    uint64_t parent = 0;
+    char *last = strrchr(parentPath, '/');
+    if(last) {
+        *last = 0;
+        d = lxfsDentryProbe(mp, 0, parentPath);
+        if(d && !d->negative) parent = d->entry.block;
+    }
+
+    free(parentPath);
+    return parent;
+}
+
+/* lxfsDentryInvalidate(): removes all records describing a path
+ * params: mp - mountpoint
+ * params: path - full qualified path
+ * returns: nothing
+ */
+
+void lxfsDentryInvalidate(Mountpoint *mp, const char *path) {
+    char name[MAX_FILE_PATH];
+    if(!pathComponent(name, path, pathDepth(path)-1)) return;
+
+    uint64_t parent = lxfsDentryParent(mp, path);
+
+    Dentry *d = lxfsDentryProbe(mp, 0, path);
+    if(d) lxfsDentryDrop(d);
+
+    if(parent) {
+        d = lxfsDentryProbe(mp, parent, name);
+        if(d) lxfsDentryDrop(d);
+        return;
+    }
+
+    // the parent directory isn't cached, so drop every record by this name
+    for(int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        d = &mp->dentries[i];
+        if(d->valid && d->parent && !strcmp(d->name, name)) lxfsDentryDrop(d);
+    }
+}
+
+/* lxfsDentryUpdate(): refreshes the cached copy of a modified directory entry
+ * params: mp - mountpoint
+ * params: path - full qualified path
+ * params: entry - updated directory entry
+ * returns: nothing
+ */
+
+void lxfsDentryUpdate(Mountpoint *mp, const char *path, const LXFSDirectoryEntry *entry) {
+    Dentry *d = lxfsDentryProbe(mp, 0, path);
+    if(!d || d->negative) {
+        // not cached as a full path, so be conservative
+        lxfsDentryInvalidate(mp, path);
+        return;
+    }
+
+    memcpy(&d->entry, entry, entry->entrySize);
+
+    d = lxfsDentryProbe(mp, d->dir, (const char *) entry->name);
+    if(d && !d->negative) memcpy(&d->entry, entry, entry->entrySize);
+}
+
+/* lxfsDentryTouch(): updates the timestamps of a cached directory entry
+ * params: mp - mountpoint
+ * params: path - full qualified path
+ * params: accessTime - new access time
+ * params: modTime - new modification time
+ * returns: nothing
+ */
+
+void lxfsDentryTouch(Mountpoint *mp, const char *path, uint64_t accessTime, uint64_t modTime) {
+    Dentry *d = lxfsDentryProbe(mp, 0, path);
+    if(!d || d->negative) {
+        lxfsDentryInvalidate(mp, path);
+        return;
+    }
+
+    d->entry.accessTime = accessTime;
+    d->entry.modTime = modTime;
+
+    d = lxfsDentryProbe(mp, d->dir, (const char *) d->entry.name);
+    if(d && !d->negative) {
+        d->entry.accessTime = accessTime;
+        d->entry.modTime = modTime;
+    }
+}
+
+/* lxfsDentryInvalidateDir(): removes all records of entries in a directory
+ * whose entries were moved
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * returns: nothing
+ */
+
+void lxfsDentryInvalidateDir(Mountpoint *mp, uint64_t dir) {
+    for(int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        Dentry *d = &mp->dentries[i];
+        if(d->valid && (d->dir == dir)) lxfsDentryDrop(d);
+    }
+}
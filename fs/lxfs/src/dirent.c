@@ -75,6 +75,191 @@ void lxfsOpendir(OpendirCommand *ocmd) {
     luxSendKernel(ocmd);
 }
 
+/* lxfsReadEntry(): reads a raw directory entry and advances past it
+ * params: mp - mountpoint
+ * params: pos - position of the entry, updated to point to the next one
+ * returns: pointer to the entry within mp->dataBuffer, NULL at the end of the
+ * directory or on I/O error, in which case pos->block is set to zero
+ */
+
+LXFSDirectoryEntry *lxfsReadEntry(Mountpoint *mp, DirPosition *pos) {
+    if(!pos->block || (pos->block == LXFS_BLOCK_EOF)) return NULL;
+
+    // avoid re-reading the same block for every entry it holds
+    if(pos->loaded != pos->block) {
+        pos->next = lxfsReadNextBlock(mp, pos->block, mp->dataBuffer);
+        if(!pos->next) {
+            pos->block = 0;
+            return NULL;
+        }
+
+        pos->loaded = pos->block;
+        pos->loadedNext = 0;
+    }
+
+    // entries may cross into the next block
+    if(!pos->loadedNext && ((pos->offset + sizeof(LXFSDirectoryEntry)) > mp->blockSizeBytes)) {
+        if(pos->next != LXFS_BLOCK_EOF) {
+            if(lxfsReadBlock(mp, pos->next, mp->dataBuffer + mp->blockSizeBytes)) {
+                pos->block = 0;
+                return NULL;
+            }
+        } else {
+            memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+        }
+
+        pos->loadedNext = 1;
+    }
+
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + pos->offset);
+    if(!entry->entrySize) {
+        pos->block = LXFS_BLOCK_EOF;    // end of directory
+        return NULL;
+    }
+
+    pos->offset += entry->entrySize;
+    pos->index++;
+    if(pos->offset >= mp->blockSizeBytes) {
+        pos->offset -= mp->blockSizeBytes;
+        pos->block = pos->next;
+    }
+
+    return entry;
+}
+
+/* lxfsEntryAt(): returns a directory entry at a known location
+ * params: mp - mountpoint
+ * params: block - block containing the entry
+ * params: offset - offset of the entry within the block
+ * entries that cross into the next block are assembled in mp->dataBuffer
+ * returns: pointer to the entry, valid until the cache is accessed again,
+ * NULL on fail
+ */
+
+LXFSDirectoryEntry *lxfsEntryAt(Mountpoint *mp, uint64_t block, off_t offset) {
+    if(offset >= mp->blockSizeBytes) return NULL;
+
+    Cache *slot = lxfsBorrowBlock(mp, block);
+    if(!slot) return NULL;
+
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)((uintptr_t)slot->data + offset);
+    size_t remaining = mp->blockSizeBytes - offset;
+    if((remaining < (sizeof(LXFSDirectoryEntry) - 512)) || (entry->entrySize > remaining)) {
+        memcpy(mp->dataBuffer, slot->data, mp->blockSizeBytes);
+
+        uint64_t next = lxfsNextBlock(mp, block);
+        if(next && (next != LXFS_BLOCK_EOF)) {
+            if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) {
+                lxfsReturnBlock(slot);
+                return NULL;
+            }
+        } else {
+            memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+        }
+
+        entry = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+    }
+
+    lxfsReturnBlock(slot);
+    return entry;
+}
+
+/* lxfsReaddirCursor(): finds a cursor left behind by a previous readdir()
+ * params: mp - mountpoint
+ * params: path - path of the directory
+ * params: dir - first block of the directory
+ * params: position - position the cursor should be at
+ * returns: pointer to the cursor, NULL if there is none
+ */
+
+static ReaddirCursor *lxfsReaddirCursor(Mountpoint *mp, const char *path, uint64_t dir, size_t position) {
+    for(int i = 0; i < READDIR_CURSORS; i++) {
+        ReaddirCursor *cursor = &mp->cursors[i];
+        if(cursor->valid && (cursor->dir == dir) && (cursor->position == position)
+        && !strcmp(cursor->path, path))
+            return cursor;
+    }
+
+    return NULL;
+}
+
+/* lxfsReaddirSave(): saves the position of a directory listing
+ * params: mp - mountpoint
+ * params: path - path of the directory
+ * params: dir - first block of the directory
+ * params: position - position of the next readdir() call
+ * params: pos - on-disk position of the next entry
+ * returns: nothing
+ */
+
+static void lxfsReaddirSave(Mountpoint *mp, const char *path, uint64_t dir, size_t position, DirPosition *pos) {
+    // reuse the oldest cursor
+    ReaddirCursor *cursor = &mp->cursors[0];
+    for(int i = 0; i < READDIR_CURSORS; i++) {
+        if(!mp->cursors[i].valid) {
+            cursor = &mp->cursors[i];
+            break;
+        }
+
+        if(mp->cursors[i].lastUsed < cursor->lastUsed) cursor = &mp->cursors[i];
+    }
+
+    if(!cursor->valid || strcmp(cursor->path, path)) {
+        free(cursor->path);
+        cursor->path = strdup(path);
+        if(!cursor->path) {
+            cursor->valid = 0;
+            return;
+        }
+    }
+
+    cursor->valid = 1;
+    cursor->dir = dir;
+    cursor->position = position;
+    cursor->pos = *pos;
+    cursor->pos.loaded = 0;     // the data buffer won't survive until then
+    cursor->lastUsed = ++mp->cursorTick;
+}
+
+/* lxfsReaddirInvalidate(): discards all cursors into a directory
+ * params: mp - mountpoint
+ * params: dir - first block of the directory that was modified
+ * returns: nothing
+ */
+
+void lxfsReaddirInvalidate(Mountpoint *mp, uint64_t dir) {
+    for(int i = 0; i < READDIR_CURSORS; i++) {
+        if(mp->cursors[i].valid && (mp->cursors[i].dir == dir))
+            mp->cursors[i].valid = 0;
+    }
+}
+
+/* lxfsFindParent(): finds the entry of the parent of a directory
+ * params: parent - destination to store the parent's entry
+ * params: mp - mountpoint
+ * params: path - path of the directory
+ * params: entry - entry of the directory itself, used for the root
+ * returns: zero on success, -1 if out of memory
+ */
+
+static int lxfsFindParent(LXFSDirectoryEntry *parent, Mountpoint *mp, const char *path, LXFSDirectoryEntry *entry) {
+    memcpy(parent, entry, sizeof(LXFSDirectoryEntry));
+    if(strlen(path) <= 1) return 0;
+
+    char *parentPath = strdup(path);
+    if(!parentPath) return -1;
+
+    char *last = strrchr(parentPath, '/');
+    if(last && (last != parentPath)) {
+        *last = 0;  // truncate
+        if(!lxfsFind(parent, mp, parentPath, NULL, NULL))
+            memcpy(parent, entry, sizeof(LXFSDirectoryEntry));
+    }
+
+    free(parentPath);
+    return 0;
+}
+
 /* lxfsReaddir(): reads a directory entry from an lxfs volume
  * params: rcmd - read directory command message
  * returns: nothing, response relayed to vfs
@@ -116,32 +301,14 @@ void lxfsReaddir(ReaddirCommand *rcmd) {
         return;
     } else if(rcmd->position == 1) {
         strcpy(rcmd->entry.d_name, "..");
-        if(strlen(rcmd->path) <= 1) {
-            rcmd->entry.d_ino = entry.block;
-        } else {
-            // find the parent so we can use its inode number
-            char *parentPath = strdup(rcmd->path);
-            if(!parentPath) {
-                rcmd->header.header.status = -ENOMEM;
-                luxSendKernel(rcmd);
-                return;
-            }
-
-            char *last = strrchr(parentPath, '/');
-            if(!last || (last == parentPath)) {
-                rcmd->entry.d_ino = entry.block;
-            } else {
-                *last = 0;  // truncate
-                LXFSDirectoryEntry parent;
-                if(!lxfsFind(&parent, mp, parentPath, NULL, NULL))
-                    rcmd->entry.d_ino = entry.block;
-                else
-                    rcmd->entry.d_ino = parent.block;
-            }
-
-            free(parentPath);
+        LXFSDirectoryEntry parent;
+        if(lxfsFindParent(&parent, mp, rcmd->path, &entry)) {
+            rcmd->header.header.status = -ENOMEM;
+            luxSendKernel(rcmd);
+            return;
         }
 
+        rcmd->entry.d_ino = parent.block;
         rcmd->position++;
         rcmd->end = 0;
         rcmd->header.header.status = 0;
@@ -149,83 +316,180 @@ void lxfsReaddir(ReaddirCommand *rcmd) {
         return;
     }
 
-    // now simply iterate over the directory
-    size_t position = 0;
-    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-    uint64_t next = entry.block;
+    // positions past the first two count raw entries in the directory, so
+    // that deleted entries can be skipped without shifting later positions
+    // continue from where the last call left off if possible, and otherwise
+    // rescan from the start of the directory
+    DirPosition pos;
+    ReaddirCursor *cursor = lxfsReaddirCursor(mp, rcmd->path, entry.block, rcmd->position);
+    if(cursor) {
+        pos = cursor->pos;
+        cursor->valid = 0;
+    } else {
+        pos.block = entry.block;
+        pos.offset = sizeof(LXFSDirectoryHeader);
+        pos.index = 0;
+        pos.loaded = 0;
+    }
+
+    LXFSDirectoryEntry *dir;
+    while((dir = lxfsReadEntry(mp, &pos))) {
+        if((dir->flags & LXFS_DIR_VALID) && ((pos.index + 1) >= rcmd->position)) {
+            strcpy(rcmd->entry.d_name, (char *) dir->name);
+            rcmd->entry.d_ino = dir->block;
+            rcmd->position = pos.index + 2;
+            rcmd->end = 0;
+            rcmd->header.header.status = 0;
+            lxfsReaddirSave(mp, rcmd->path, entry.block, rcmd->position, &pos);
+            luxSendKernel(rcmd);
+            return;
+        }
+    }
 
-    if(lxfsReadBlock(mp, next, mp->dataBuffer)) {
+    if(!pos.block) {
         rcmd->header.header.status = -EIO;
         luxSendKernel(rcmd);
         return;
     }
 
-    while(dir->entrySize) {
-        next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-        if(!next) {
-            rcmd->header.header.status = -EIO;
-            luxSendKernel(rcmd);
-            return;
-        }
+    rcmd->header.header.status = 0;
+    rcmd->end = 1;
+    luxSendKernel(rcmd);
+}
 
-        // read two blocks at a time for entries that cross boundaries
-        if(next != LXFS_BLOCK_EOF)
-            lxfsReadNextBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes);
-        
-        dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-        off_t offset = sizeof(LXFSDirectoryHeader);
-
-        while(offset < mp->blockSizeBytes) {
-            if((dir->flags & LXFS_DIR_VALID) && (position == (rcmd->position-2))) {
-                strcpy(rcmd->entry.d_name, (char *) dir->name);
-                rcmd->entry.d_ino = dir->block;
-                rcmd->position++;
-                rcmd->end = 0;
-                rcmd->header.header.status = 0;
-                luxSendKernel(rcmd);
-                return;
-            }
+/* lxfsGetdents(): reads as many directory entries as fit in one message
+ * params: gcmd - getdents command message
+ * returns: nothing, response relayed to vfs
+ */
 
-            // skip over to the next entry
-            position++;
+void lxfsGetdents(GetdentsCommand *gcmd) {
+    gcmd->header.header.response = 1;
+    gcmd->header.header.length = sizeof(GetdentsCommand);
 
-            uint16_t oldSize = dir->entrySize;
-            if(!oldSize) {
-                rcmd->header.header.status = 0;
-                rcmd->end = 1;
-                luxSendKernel(rcmd);
-                return;
+    Mountpoint *mp = findMP(gcmd->device);
+    if(!mp) {
+        gcmd->header.header.status = -EIO;  // device doesn't exist
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    LXFSDirectoryEntry entry;
+    if(!lxfsFind(&entry, mp, gcmd->path, NULL, NULL)) {
+        gcmd->header.header.status = -ENOENT;   // file doesn't exist
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    if(((entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_DIR) {
+        gcmd->header.header.status = -ENOTDIR;
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    LXFSDirectoryEntry parent;
+    if(lxfsFindParent(&parent, mp, gcmd->path, &entry)) {
+        gcmd->header.header.status = -ENOMEM;
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    // the response can't be larger than a message
+    size_t capacity = gcmd->length;
+    if(capacity > (SERVER_MAX_SIZE - sizeof(GetdentsCommand)))
+        capacity = SERVER_MAX_SIZE - sizeof(GetdentsCommand);
+
+    GetdentsCommand *res = calloc(1, sizeof(GetdentsCommand) + capacity);
+    if(!res) {
+        gcmd->header.header.status = -ENOMEM;
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    memcpy(res, gcmd, sizeof(GetdentsCommand));
+    res->header.header.status = 0;
+    res->length = 0;
+    res->count = 0;
+    res->end = 0;
+
+    // same positions as readdir_r(), and resuming from the same cursors
+    DirPosition pos;
+    ReaddirCursor *cursor = NULL;
+    if(gcmd->position >= 2)
+        cursor = lxfsReaddirCursor(mp, gcmd->path, entry.block, gcmd->position);
+
+    if(cursor) {
+        pos = cursor->pos;
+        cursor->valid = 0;
+    } else {
+        pos.block = entry.block;
+        pos.offset = sizeof(LXFSDirectoryHeader);
+        pos.index = 0;
+        pos.loaded = 0;
+    }
+
+    size_t position = gcmd->position;
+    DirPosition last = pos;
+
+    for(;;) {
+        LXFSDirectoryEntry *dir;
+        size_t next;
+
+        if(position == 0) {
+            dir = &entry;
+            next = 1;
+        } else if(position == 1) {
+            dir = &parent;
+            next = 2;
+        } else {
+            while((dir = lxfsReadEntry(mp, &pos))) {
+                if((dir->flags & LXFS_DIR_VALID) && ((pos.index + 1) >= position))
+                    break;
             }
 
-            dir = (LXFSDirectoryEntry *)((uintptr_t)dir + oldSize);
-            offset += oldSize;
-
-            if((offset >= mp->blockSizeBytes) && (next != LXFS_BLOCK_EOF)) {
-                // copy the second block to the first block
-                offset -= mp->blockSizeBytes;
-                dir = (LXFSDirectoryEntry *)((uintptr_t)dir - mp->blockSizeBytes);
-                memmove(mp->dataBuffer, mp->dataBuffer+mp->blockSizeBytes, mp->blockSizeBytes);
-
-                if(!dir->entrySize) {
-                    rcmd->header.header.status = 0;
-                    rcmd->end = 1;
-                    luxSendKernel(rcmd);
-                    return;
-                }
-
-                // and read the next block
-                next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-                if(!next) {
-                    rcmd->header.header.status = -EIO;
-                    luxSendKernel(rcmd);
-                    return;
-                }
+            if(!dir) {
+                if(!pos.block) res->header.header.status = -EIO;
+                else res->end = 1;
+                break;
             }
+
+            next = pos.index + 2;
         }
+
+        const char *name = (position == 0) ? "." : (position == 1) ? ".." : (const char *) dir->name;
+        size_t recordSize = (sizeof(DirentRecord) + strlen(name) + 1 + 7) & ~7;
+        if((res->length + recordSize) > capacity) {
+            // at least one record must fit
+            if(!res->count) res->header.header.status = -EINVAL;
+            break;
+        }
+
+        DirentRecord *record = (DirentRecord *)((uintptr_t)res->data + res->length);
+        record->length = recordSize;
+        record->position = next;
+        record->inode = dir->block;
+        strcpy(record->name, name);
+
+        // this only reads the metadata block, leaving the directory intact
+        if(gcmd->flags & GETDENTS_STAT) {
+            record->flags = GETDENTS_STAT;
+            if(lxfsStatEntry(mp, dir, &record->status)) {
+                res->header.header.status = -EIO;
+                break;
+            }
+        }
+
+        res->length += recordSize;
+        res->count++;
+        position = next;
+        last = pos;
     }
 
-    rcmd->header.header.status = 0;
-    rcmd->end = 1;
-    luxSendKernel(rcmd);
-    return;
-}
\ No newline at end of file
+    if(res->header.header.status && res->count) res->header.header.status = 0;
+    if(!res->end && (position >= 2))
+        lxfsReaddirSave(mp, gcmd->path, entry.block, position, &last);
+
+    res->position = position;
+    res->header.header.length += res->length;
+    luxSendKernel(res);
+    free(res);
+}
@@ -0,0 +1,426 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+/* On volumes with LXFS_FEATURE_DIR_INDEX, directories with at least
+ * INDEX_THRESHOLD entries get a hash index, so that lookups read one bucket
+ * block and the block holding the entry instead of the whole directory, and
+ * new entries are appended at the end recorded in the index instead of
+ * after a scan for free space. The directory itself stays a complete linear
+ * list, so drivers that know nothing about the index can still read it.
+ *
+ * Those drivers will also change the directory without updating the index,
+ * which is noticed because the index header keeps a copy of the entry and
+ * byte counts of the directory header. Every change made by an older driver
+ * changes at least one of them, and an index that doesn't match is dropped
+ * and rebuilt by the next create once the directory is large enough.
+ */
+
+/* lxfsIndexCapacity(): returns the number of slots in a bucket block
+ * params: mp - mountpoint
+ * returns: number of slots
+ */
+
+static uint32_t lxfsIndexCapacity(Mountpoint *mp) {
+    return (mp->blockSizeBytes - sizeof(LXFSIndexBucket)) / sizeof(LXFSIndexSlot);
+}
+
+/* lxfsIndexOpen(): reads the hash index header of a directory, dropping the
+ * index if the directory was changed without it
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: header - buffer to copy the index header to
+ * returns: first block of the index, zero if there is no usable index
+ */
+
+static uint64_t lxfsIndexOpen(Mountpoint *mp, uint64_t dir, LXFSIndexHeader *header) {
+    if(!(mp->features & LXFS_FEATURE_DIR_INDEX)) return 0;
+
+    Cache *slot = lxfsBorrowBlock(mp, dir);
+    if(!slot) return 0;
+
+    LXFSDirectoryHeader dirHeader;
+    memcpy(&dirHeader, slot->data, sizeof(LXFSDirectoryHeader));
+    lxfsReturnBlock(slot);
+
+    if(!dirHeader.index) return 0;
+    if((dirHeader.index < 33) || (dirHeader.index >= mp->volumeSize)) {
+        lxfsIndexDrop(mp, dir);
+        return 0;
+    }
+
+    slot = lxfsBorrowBlock(mp, dirHeader.index);
+    if(!slot) return 0;
+
+    memcpy(header, slot->data, sizeof(LXFSIndexHeader));
+    lxfsReturnBlock(slot);
+
+    if((header->identifier != LXFS_INDEX_MAGIC) || !header->buckets
+    || (header->buckets & (header->buckets - 1))
+    || ((dirHeader.index + header->buckets) >= mp->volumeSize)
+    || (header->sizeEntries != dirHeader.sizeEntries)
+    || (header->sizeBytes != dirHeader.sizeBytes)) {
+        lxfsIndexDrop(mp, dir);
+        return 0;
+    }
+
+    return dirHeader.index;
+}
+
+/* lxfsIndexDrop(): removes the hash index of a directory
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * returns: nothing
+ */
+
+void lxfsIndexDrop(Mountpoint *mp, uint64_t dir) {
+    Cache *slot = lxfsBorrowBlock(mp, dir);
+    if(!slot) return;
+
+    uint64_t index = ((LXFSDirectoryHeader *) slot->data)->index;
+    lxfsReturnBlock(slot);
+    if(!index) return;
+
+    uint64_t none = 0;
+    if(lxfsWritePartial(mp, 0, dir, offsetof(LXFSDirectoryHeader, index), &none, sizeof(uint64_t)))
+        return;
+
+    // only free blocks that are recognizably an index
+    if((index < 33) || (index >= mp->volumeSize)) return;
+
+    slot = lxfsBorrowBlock(mp, index);
+    if(!slot) return;
+
+    int valid = ((LXFSIndexHeader *) slot->data)->identifier == LXFS_INDEX_MAGIC;
+    lxfsReturnBlock(slot);
+    if(valid) lxfsFreeChain(mp, index);
+}
+
+/* lxfsIndexBuild(): builds the hash index of a directory from its entries,
+ * replacing any existing index
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: minBuckets - minimum number of buckets, zero to size the index
+ * by the number of entries alone
+ * returns: zero on success
+ */
+
+int lxfsIndexBuild(Mountpoint *mp, uint64_t dir, uint32_t minBuckets) {
+    if(!(mp->features & LXFS_FEATURE_DIR_INDEX)) return 1;
+
+    Cache *slot = lxfsBorrowBlock(mp, dir);
+    if(!slot) return 1;
+
+    LXFSDirectoryHeader dirHeader;
+    memcpy(&dirHeader, slot->data, sizeof(LXFSDirectoryHeader));
+    lxfsReturnBlock(slot);
+
+    // start out with buckets half full on average, doubling them if any one
+    // of them overflows
+    uint32_t capacity = lxfsIndexCapacity(mp);
+    uint32_t buckets = 4;
+    while((buckets < minBuckets) || (((uint64_t) buckets * capacity) < (dirHeader.sizeEntries * 2)))
+        buckets *= 2;
+
+    uint32_t maxBuckets = buckets * 16;
+    uint8_t *data;
+    LXFSIndexHeader *header;
+    DirPosition pos;
+
+    for(;;) {
+        if((buckets > maxBuckets) || ((buckets + 1) >= mp->freeBlocks)) return 1;
+
+        data = calloc(buckets + 1, mp->blockSizeBytes);
+        if(!data) return 1;
+
+        header = (LXFSIndexHeader *) data;
+        header->endBlock = dir;
+
+        pos.block = dir;
+        pos.offset = sizeof(LXFSDirectoryHeader);
+        pos.index = 0;
+        pos.loaded = 0;
+
+        int full = 0;
+        LXFSDirectoryEntry *entry;
+        for(;;) {
+            // the position before the end of the directory is where the next
+            // entry goes, which may be just past the end of its last block
+            uint64_t block = pos.block;
+            off_t offset = pos.offset;
+            if(block != LXFS_BLOCK_EOF) {
+                header->endBlock = block;
+                header->endOffset = offset;
+            } else {
+                header->endOffset = offset + mp->blockSizeBytes;
+            }
+
+            entry = lxfsReadEntry(mp, &pos);
+            if(!entry) break;
+            if(!(entry->flags & LXFS_DIR_VALID)) continue;
+
+            uint32_t hash = entry->nameHash ? entry->nameHash : lxfsNameHash((const char *) entry->name);
+            uint8_t *bucketData = data + ((1 + (hash & (buckets - 1))) * mp->blockSizeBytes);
+            LXFSIndexBucket *bucket = (LXFSIndexBucket *) bucketData;
+            if(bucket->count >= capacity) {
+                full = 1;
+                break;
+            }
+
+            LXFSIndexSlot *slots = (LXFSIndexSlot *)(bucketData + sizeof(LXFSIndexBucket));
+            slots[bucket->count].hash = hash;
+            slots[bucket->count].offset = offset;
+            slots[bucket->count].block = block;
+            bucket->count++;
+        }
+
+        if(!full) break;
+
+        free(data);
+        buckets *= 2;
+    }
+
+    if(!pos.block) {
+        free(data);
+        return 1;   // I/O error
+    }
+
+    header->identifier = LXFS_INDEX_MAGIC;
+    header->buckets = buckets;
+    header->sizeEntries = dirHeader.sizeEntries;
+    header->sizeBytes = dirHeader.sizeBytes;
+
+    // keep the index next to the directory, in one run so that a bucket's
+    // block can be found without walking the chain
+    uint64_t index = lxfsAllocateRun(mp, buckets + 1, dir);
+    if(!index) {
+        free(data);
+        return 1;
+    }
+
+    for(uint32_t i = 0; i <= buckets; i++) {
+        if(lxfsWriteBlock(mp, index + i, data + (i * mp->blockSizeBytes))) {
+            free(data);
+            lxfsFreeChain(mp, index);
+            return 1;
+        }
+    }
+
+    free(data);
+
+    // the index must reach the disk before the directory points to it
+    if(lxfsFlushAll(mp)) {
+        lxfsFreeChain(mp, index);
+        return 1;
+    }
+
+    lxfsIndexDrop(mp, dir);
+    if(lxfsWritePartial(mp, 0, dir, offsetof(LXFSDirectoryHeader, index), &index, sizeof(uint64_t))) {
+        lxfsFreeChain(mp, index);
+        return 1;
+    }
+
+    lxfsFlushBlock(mp, dir);
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: indexed directory at block %d with %d entries in %d buckets\n",
+        mp->device, dir, dirHeader.sizeEntries, buckets);
+    return 0;
+}
+
+/* lxfsIndexLookup(): looks up a directory entry through the hash index
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: name - name of the entry
+ * params: hash - hash of the name
+ * params: entry - pointer to store a pointer to the entry, valid until the
+ * cache is accessed again, NULL if the entry doesn't exist
+ * params: blockPtr - pointer to store the block containing the entry
+ * params: offPtr - pointer to store the offset of the entry within the block
+ * returns: zero if the index answered, non-zero if the directory has to be
+ * scanned instead
+ */
+
+int lxfsIndexLookup(Mountpoint *mp, uint64_t dir, const char *name, uint32_t hash,
+                    LXFSDirectoryEntry **entry, uint64_t *blockPtr, off_t *offPtr) {
+    LXFSIndexHeader header;
+    uint64_t index = lxfsIndexOpen(mp, dir, &header);
+    if(!index) return 1;
+
+    Cache *bucket = lxfsBorrowBlock(mp, index + 1 + (hash & (header.buckets - 1)));
+    if(!bucket) return 1;
+
+    mp->indexLookups++;
+
+    uint32_t count = ((LXFSIndexBucket *) bucket->data)->count;
+    LXFSIndexSlot *slots = (LXFSIndexSlot *)((uintptr_t)bucket->data + sizeof(LXFSIndexBucket));
+    if(count > lxfsIndexCapacity(mp)) count = lxfsIndexCapacity(mp);
+
+    for(uint32_t i = 0; i < count; i++) {
+        if(slots[i].hash != hash) continue;
+
+        LXFSDirectoryEntry *candidate = lxfsEntryAt(mp, slots[i].block, slots[i].offset);
+        if(!candidate) {
+            lxfsReturnBlock(bucket);
+            return 1;
+        }
+
+        mp->nameCompares++;
+        if((candidate->flags & LXFS_DIR_VALID) && !strcmp((const char *) candidate->name, name)) {
+            *blockPtr = slots[i].block;
+            *offPtr = slots[i].offset;
+            *entry = candidate;
+            lxfsReturnBlock(bucket);
+            return 0;
+        }
+    }
+
+    lxfsReturnBlock(bucket);
+    *entry = NULL;
+    return 0;
+}
+
+/* lxfsIndexInsert(): adds an entry to its bucket in the hash index
+ * params: mp - mountpoint
+ * params: index - first block of the index
+ * params: header - index header
+ * params: hash - hash of the entry's name
+ * params: block - block containing the entry
+ * params: offset - offset of the entry within the block
+ * returns: zero on success, non-zero if the bucket is full
+ */
+
+static int lxfsIndexInsert(Mountpoint *mp, uint64_t index, const LXFSIndexHeader *header,
+                           uint32_t hash, uint64_t block, off_t offset) {
+    uint64_t bucketBlock = index + 1 + (hash & (header->buckets - 1));
+    Cache *bucket = lxfsBorrowBlock(mp, bucketBlock);
+    if(!bucket) return 1;
+
+    uint32_t count = ((LXFSIndexBucket *) bucket->data)->count;
+    lxfsReturnBlock(bucket);
+    if(count >= lxfsIndexCapacity(mp)) return 1;
+
+    LXFSIndexSlot slot;
+    slot.hash = hash;
+    slot.offset = offset;
+    slot.block = block;
+
+    off_t slotOffset = sizeof(LXFSIndexBucket) + (count * sizeof(LXFSIndexSlot));
+    count++;
+    if(lxfsWritePartial(mp, 0, bucketBlock, slotOffset, &slot, sizeof(LXFSIndexSlot))
+    || lxfsWritePartial(mp, 0, bucketBlock, 0, &count, sizeof(uint32_t)))
+        return 1;
+
+    // the bucket must be on disk before the counts that validate it
+    return lxfsFlushBlock(mp, bucketBlock);
+}
+
+/* lxfsIndexAppend(): appends a new entry to the end of an indexed directory
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: dest - entry to append, with its name hash set
+ * the caller is expected to then update the directory header counts, which
+ * the index header is updated in anticipation of
+ * returns: zero on success, negative error code on fail, positive if the
+ * directory has no usable index
+ */
+
+int lxfsIndexAppend(Mountpoint *mp, uint64_t dir, const LXFSDirectoryEntry *dest) {
+    LXFSIndexHeader header;
+    uint64_t index = lxfsIndexOpen(mp, dir, &header);
+    if(!index) return 1;
+
+    uint64_t block = header.endBlock;
+    off_t offset = header.endOffset;
+    int status = lxfsAppendEntry(mp, block, offset, dest);
+    if(status) return status;
+
+    // the entry may have started at the beginning of the next block
+    if(offset >= mp->blockSizeBytes) {
+        block = lxfsNextBlock(mp, block);
+        offset -= mp->blockSizeBytes;
+    }
+
+    header.sizeEntries++;
+    header.sizeBytes += dest->entrySize;
+    header.endBlock = block;
+    header.endOffset = offset + dest->entrySize;
+    if(header.endOffset > mp->blockSizeBytes) {
+        header.endBlock = lxfsNextBlock(mp, block);
+        header.endOffset -= mp->blockSizeBytes;
+    }
+
+    // a full bucket leaves the directory without an index until the caller
+    // rebuilds it with more buckets
+    if(lxfsIndexInsert(mp, index, &header, dest->nameHash, block, offset)) {
+        lxfsIndexDrop(mp, dir);
+        return 0;
+    }
+
+    if(lxfsWritePartial(mp, 0, index, 0, &header, sizeof(LXFSIndexHeader)))
+        lxfsIndexDrop(mp, dir);
+    return 0;
+}
+
+/* lxfsIndexRemove(): removes a deleted entry from the hash index
+ * params: mp - mountpoint
+ * params: dir - first block of the directory
+ * params: hash - hash of the entry's name
+ * params: block - block containing the entry
+ * params: offset - offset of the entry within the block
+ * the caller is expected to then decrement the directory header entry count,
+ * which the index header is updated in anticipation of
+ * returns: nothing
+ */
+
+void lxfsIndexRemove(Mountpoint *mp, uint64_t dir, uint32_t hash, uint64_t block, off_t offset) {
+    LXFSIndexHeader header;
+    uint64_t index = lxfsIndexOpen(mp, dir, &header);
+    if(!index) return;
+
+    uint64_t bucketBlock = index + 1 + (hash & (header.buckets - 1));
+    Cache *bucket = lxfsBorrowBlock(mp, bucketBlock);
+    if(!bucket) {
+        lxfsIndexDrop(mp, dir);
+        return;
+    }
+
+    uint32_t count = ((LXFSIndexBucket *) bucket->data)->count;
+    LXFSIndexSlot *slots = (LXFSIndexSlot *)((uintptr_t)bucket->data + sizeof(LXFSIndexBucket));
+    if(count > lxfsIndexCapacity(mp)) count = lxfsIndexCapacity(mp);
+
+    uint32_t i;
+    for(i = 0; i < count; i++) {
+        if((slots[i].block == block) && (slots[i].offset == offset)) break;
+    }
+
+    LXFSIndexSlot last;
+    if(i < count) memcpy(&last, &slots[count-1], sizeof(LXFSIndexSlot));
+    lxfsReturnBlock(bucket);
+
+    if(i == count) {
+        lxfsIndexDrop(mp, dir);     // the index doesn't match the directory
+        return;
+    }
+
+    // move the last slot into the one being removed
+    count--;
+    if(lxfsWritePartial(mp, 0, bucketBlock, sizeof(LXFSIndexBucket) + (i * sizeof(LXFSIndexSlot)), &last, sizeof(LXFSIndexSlot))
+    || lxfsWritePartial(mp, 0, bucketBlock, 0, &count, sizeof(uint32_t))
+    || lxfsFlushBlock(mp, bucketBlock)) {
+        lxfsIndexDrop(mp, dir);
+        return;
+    }
+
+    header.sizeEntries--;
+    if(lxfsWritePartial(mp, 0, index, 0, &header, sizeof(LXFSIndexHeader)))
+        lxfsIndexDrop(mp, dir);
+}
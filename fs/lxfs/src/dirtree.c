@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stddef.h>
 
 /* pathDepth(): helper function to calculate the depth of a path
  * params: path - full qualified path
@@ -62,12 +63,255 @@ char *pathComponent(char *dest, const char *path, int n) {
     return NULL;
 }
 
+/* lxfsNameHash(): hashes the name of a directory entry
+ * params: name - file name
+ * returns: 32-bit hash, never zero
+ */
+
+uint32_t lxfsNameHash(const char *name) {
+    uint32_t hash = 0x811C9DC5;
+    while(*name) {
+        hash ^= (uint8_t) *name;
+        hash *= 0x01000193;
+        name++;
+    }
+
+    // zero is left for entries that don't have a hash
+    return hash ? hash : 1;
+}
+
+/* lxfsScanDirectory(): searches a directory for an entry by name
+ * params: mp - lxfs mountpoint
+ * params: dir - first block of the directory
+ * params: name - name of the entry
+ * params: blockPtr - pointer to store the block containing the entry
+ * params: offPtr - pointer to store the offset of the entry within the block
+ * directory blocks are scanned in place in the cache, except for entries that
+ * cross into the next block, which are assembled in mp->dataBuffer
+ * returns: pointer to the entry, valid until the cache is accessed again,
+ * NULL on fail
+ * sets *blockPtr to zero if the entry doesn't exist, non-zero on I/O errors
+ */
+
+static LXFSDirectoryEntry *lxfsScanDirectory(Mountpoint *mp, uint64_t dir, const char *name,
+                                             uint64_t *blockPtr, off_t *offPtr) {
+    *blockPtr = 1;  // I/O error until proven otherwise
+
+    // entries with a hash only need their name compared when the hash matches
+    uint32_t hash = lxfsNameHash(name);
+
+    // and large directories are looked up through their hash index
+    LXFSDirectoryEntry *indexed;
+    if(!lxfsIndexLookup(mp, dir, name, hash, &indexed, blockPtr, offPtr)) {
+        if(!indexed) *blockPtr = 0;
+        return indexed;
+    }
+
+    uint64_t block = dir;
+    Cache *slot = lxfsBorrowBlock(mp, block);
+    if(!slot) return NULL;
+
+    uint64_t next = lxfsNextBlock(mp, block);
+    if(!next) {
+        lxfsReturnBlock(slot);
+        return NULL;
+    }
+
+    off_t offset = sizeof(LXFSDirectoryHeader);
+    for(;;) {
+        LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)((uintptr_t)slot->data + offset);
+        size_t remaining = mp->blockSizeBytes - offset;
+        if((remaining < (sizeof(LXFSDirectoryEntry) - 512)) || (entry->entrySize > remaining)) {
+            // the entry crosses a block boundary, so copy both blocks
+            memcpy(mp->dataBuffer, slot->data, mp->blockSizeBytes);
+            if(next != LXFS_BLOCK_EOF) {
+                if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) {
+                    lxfsReturnBlock(slot);
+                    return NULL;
+                }
+            } else {
+                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+            }
+
+            entry = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+        }
+
+        if(!entry->entrySize) break;    // end of directory
+
+        mp->scannedEntries++;
+        if((entry->flags & LXFS_DIR_VALID) && (!entry->nameHash || (entry->nameHash == hash))) {
+            mp->nameCompares++;
+            if(!strcmp((const char *) entry->name, name)) {
+                lxfsReturnBlock(slot);
+                *blockPtr = block;
+                *offPtr = offset;
+                return entry;
+            }
+        }
+
+        // advance to the next entry
+        offset += entry->entrySize;
+        if(offset >= mp->blockSizeBytes) {
+            if(next == LXFS_BLOCK_EOF) break;
+
+            offset -= mp->blockSizeBytes;
+            lxfsReturnBlock(slot);
+            block = next;
+
+            slot = lxfsBorrowBlock(mp, block);
+            if(!slot) return NULL;
+
+            next = lxfsNextBlock(mp, block);
+            if(!next) {
+                lxfsReturnBlock(slot);
+                return NULL;
+            }
+        }
+    }
+
+    lxfsReturnBlock(slot);
+    *blockPtr = 0;  // file doesn't exist
+    return NULL;
+}
+
+/* lxfsHashDirectory(): gives every entry in a directory without a name hash
+ * its hash, in place in the cache
+ * params: mp - lxfs mountpoint
+ * params: dir - first block of the directory
+ * params: stack - pointer to the list of directories still to be visited,
+ * which subdirectories are added to
+ * params: count - pointer to the number of directories on the list
+ * params: capacity - pointer to the size of the list
+ * returns: number of entries updated, negative on fail
+ */
+
+static int64_t lxfsHashDirectory(Mountpoint *mp, uint64_t dir, uint64_t **stack,
+                                 size_t *count, size_t *capacity) {
+    int64_t updated = 0;
+    uint64_t block = dir;
+    Cache *slot = lxfsBorrowBlock(mp, block);
+    if(!slot) return -1;
+
+    uint64_t next = lxfsNextBlock(mp, block);
+    if(!next) {
+        lxfsReturnBlock(slot);
+        return -1;
+    }
+
+    off_t offset = sizeof(LXFSDirectoryHeader);
+    for(;;) {
+        LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)((uintptr_t)slot->data + offset);
+        size_t remaining = mp->blockSizeBytes - offset;
+        if((remaining < (sizeof(LXFSDirectoryEntry) - 512)) || (entry->entrySize > remaining)) {
+            // same as in lxfsScanDirectory(), the hash itself is written
+            // through the cache rather than to this copy
+            memcpy(mp->dataBuffer, slot->data, mp->blockSizeBytes);
+            if(next != LXFS_BLOCK_EOF) {
+                if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) {
+                    lxfsReturnBlock(slot);
+                    return -1;
+                }
+            } else {
+                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+            }
+
+            entry = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+        }
+
+        if(!entry->entrySize) break;
+
+        if(entry->flags & LXFS_DIR_VALID) {
+            if(!entry->nameHash) {
+                uint32_t hash = lxfsNameHash((const char *) entry->name);
+                if(lxfsWritePartial(mp, 0, block, offset + offsetof(LXFSDirectoryEntry, nameHash),
+                                    &hash, sizeof(uint32_t))) {
+                    lxfsReturnBlock(slot);
+                    return -1;
+                }
+
+                updated++;
+            }
+
+            if(((entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) == LXFS_DIR_TYPE_DIR) {
+                if(*count == *capacity) {
+                    uint64_t *list = realloc(*stack, (*capacity * 2) * sizeof(uint64_t));
+                    if(!list) {
+                        lxfsReturnBlock(slot);
+                        return -1;
+                    }
+
+                    *stack = list;
+                    *capacity *= 2;
+                }
+
+                (*stack)[(*count)++] = entry->block;
+            }
+        }
+
+        offset += entry->entrySize;
+        if(offset >= mp->blockSizeBytes) {
+            if(next == LXFS_BLOCK_EOF) break;
+
+            offset -= mp->blockSizeBytes;
+            lxfsReturnBlock(slot);
+            block = next;
+
+            slot = lxfsBorrowBlock(mp, block);
+            if(!slot) return -1;
+
+            next = lxfsNextBlock(mp, block);
+            if(!next) {
+                lxfsReturnBlock(slot);
+                return -1;
+            }
+        }
+    }
+
+    lxfsReturnBlock(slot);
+    return updated;
+}
+
+/* lxfsNameHashUpgrade(): gives every directory entry on a volume that was
+ * written by an older driver its name hash, visiting each directory once
+ * params: mp - lxfs mountpoint
+ * returns: zero on success
+ */
+
+int lxfsNameHashUpgrade(Mountpoint *mp) {
+    size_t count = 0, capacity = 64;
+    uint64_t *stack = malloc(capacity * sizeof(uint64_t));
+    if(!stack) return 1;
+
+    stack[count++] = mp->root;
+
+    uint64_t directories = 0, updated = 0;
+    while(count) {
+        int64_t status = lxfsHashDirectory(mp, stack[--count], &stack, &count, &capacity);
+        if(status < 0) {
+            free(stack);
+            return 1;
+        }
+
+        directories++;
+        updated += status;
+    }
+
+    free(stack);
+    if(lxfsFlushAll(mp)) return 1;
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: added name hashes to %d entries in %d directories\n",
+        mp->device, updated, directories);
+    return 0;
+}
+
 /* lxfsFind(): finds the directory entry associated with a file
  * params: dest - destination buffer to store the directory entry
  * params: mp - lxfs mountpoint
  * params: path - full qualified path
  * params: blockPtr - pointer to store starting block
  * params: offPtr - pointer to store starting offset within the block
+ * if either pointer is given, mp->dataBuffer holds the block containing the
+ * entry on success, as well as the next block if the entry crosses into it
  * returns: pointer to destination on success, NULL on fail
  */
 
@@ -97,78 +341,89 @@ LXFSDirectoryEntry *lxfsFind(LXFSDirectoryEntry *dest, Mountpoint *mp, const cha
         return dest;
     }
 
+    LXFSDirectoryEntry *entry;
+    uint64_t block;
+    off_t offset;
+
+    // try the whole path in the dentry cache first
+    Dentry *d = lxfsDentryLookup(mp, 0, path);
+    if(d) {
+        if(d->negative) return NULL;
+        entry = &d->entry;
+        block = d->block;
+        offset = d->offset;
+        goto found;
+    }
+
     // for everything else we will need to traverse the file system starting
-    // at the root directory
-    LXFSDirectoryEntry *dir;
-    uint64_t prev;
-    uint64_t next = mp->root;
+    // at the root directory, one component at a time
+    uint64_t dir = mp->root;
     int depth = pathDepth(path);
     char component[MAX_FILE_PATH];
 
-    int i = 0;
-
-traverse:
-    while(i < depth) {
-        // iterate over each component in the path and search for it in the directory
+    for(int i = 0; i < depth; i++) {
         if(!pathComponent(component, path, i)) return NULL;
 
-        prev = next;
-        next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-        if(!next) return NULL;
-        
-        // read two blocks at a time for entries that cross boundaries
-        if(next != LXFS_BLOCK_EOF)
-            lxfsReadNextBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes);
-
-        dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-        off_t offset = sizeof(LXFSDirectoryHeader);
-
-        while(offset < mp->blockSizeBytes) {
-            if((dir->flags & LXFS_DIR_VALID) && !strcmp((const char *) dir->name, component)) {
-                if(i == depth-1) {
-                    // found the file we're looking for
-                    if(blockPtr) *blockPtr = prev;
-                    if(offPtr) *offPtr = offset;
-                    return (LXFSDirectoryEntry *) memcpy(dest, dir, dir->entrySize);
-                } else {
-                    // found a parent component, ensure it is a directory
-                    i++;
-
-                    if(((dir->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_DIR)
-                        return NULL;
-
-                    // and go back to the beginning of the loop but searching for this component
-                    next = dir->block;
-                    goto traverse;
-                }
-            }
-            
-            // advance to the next entry
-            uint16_t oldSize = dir->entrySize;
-            dir = (LXFSDirectoryEntry *)((uintptr_t)dir + oldSize);
-            offset += oldSize;
-
-            if(!dir->entrySize) {
-                // file doesn't exist
+        // a full path is only recorded as being in this directory if it is
+        // the path's own parent, otherwise invalidating the path later would
+        // miss the record of its last component
+        uint64_t pathDir = (i == depth-1) ? dir : 0;
+
+        d = lxfsDentryLookup(mp, dir, component);
+        if(d && d->negative) {
+            lxfsDentryInsert(mp, 0, path, pathDir, NULL, 0, 0);
+            return NULL;
+        } else if(d) {
+            entry = &d->entry;
+            block = d->block;
+            offset = d->offset;
+        } else {
+            entry = lxfsScanDirectory(mp, dir, component, &block, &offset);
+            if(!entry) {
+                if(block) return NULL;  // I/O error, don't cache anything
+
+                lxfsDentryInsert(mp, dir, component, dir, NULL, 0, 0);
+                lxfsDentryInsert(mp, 0, path, pathDir, NULL, 0, 0);
                 return NULL;
             }
 
-            if((offset >= mp->blockSizeBytes) && (next != LXFS_BLOCK_EOF)) {
-                // copy the second block to the first block
-                offset -= mp->blockSizeBytes;
-                dir = (LXFSDirectoryEntry *)((uintptr_t)dir - mp->blockSizeBytes);
-                memmove(mp->dataBuffer, mp->dataBuffer+mp->blockSizeBytes, mp->blockSizeBytes);
-
-                if(!dir->entrySize) return NULL;
+            lxfsDentryInsert(mp, dir, component, dir, entry, block, offset);
+        }
 
-                // and read the next block
-                next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-                if(!next) return NULL;
-            }
+        if(i == depth-1) {
+            // found the file we're looking for
+            lxfsDentryInsert(mp, 0, path, dir, entry, block, offset);
+            goto found;
         }
+
+        // found a parent component, ensure it is a directory
+        if(((entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_DIR)
+            return NULL;
+
+        dir = entry->block;
     }
 
     return NULL;
+
+found:
+    memcpy(dest, entry, entry->entrySize);
+    if(!blockPtr && !offPtr) return dest;
+
+    // callers that want the location of the entry expect to find the
+    // directory block(s) holding it in the data buffer
+    if(entry != (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset)) {
+        uint64_t next = lxfsReadNextBlock(mp, block, mp->dataBuffer);
+        if(!next) return NULL;
+
+        if((offset + dest->entrySize) > mp->blockSizeBytes) {
+            if(next == LXFS_BLOCK_EOF) return NULL;
+            if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return NULL;
+        }
+    }
+
+    if(blockPtr) *blockPtr = block;
+    if(offPtr) *offPtr = offset;
+    return dest;
 }
 
 /* lxfsMkdir(): implementation of mkdir() for lxfs
@@ -0,0 +1,204 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+/* fallocate() reserves the blocks a file will need up front, so that writers
+ * that know how large a file will get pay for a single allocation, placed in
+ * as few runs as the free space allows, and later writes only copy data. The
+ * new blocks are appended to the file's chain flagged as unwritten, except for
+ * the last one which ends the chain and is zeroed instead, so they read as
+ * zeroes without being written, unless the volume can't be marked as having
+ * unwritten blocks and they are written out as zeroes after all. With
+ * FALLOCATE_KEEP_SIZE the size of the file stays as it is and the chain
+ * reaches past its end, which writes that extend the file then take over;
+ * otherwise the file grows to cover the allocated range.
+ */
+
+/* lxfsPreallocate(): appends blocks that read as zeroes to a file's chain
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * params: last - last block of the chain, the header block if there is none
+ * params: count - number of blocks to append
+ * params: newLast - pointer to store the new last block of the chain
+ * returns: zero on success, negative errno error code on fail
+ */
+
+static int lxfsPreallocate(Mountpoint *mp, uint64_t file, uint64_t last, uint64_t count, uint64_t *newLast) {
+    // the file's own reservation follows its last block, so let the
+    // allocation extend the chain in place
+    lxfsReserveRelease(mp, file);
+    uint64_t block = lxfsAllocate(mp, count, last, 0);
+    if(!block) return -ENOSPC;
+
+    uint64_t newBlock;
+    int status = lxfsZeroChain(mp, file, block, count, &newBlock);
+    if(status || lxfsSetNextBlock(mp, last, block)) {
+        lxfsFreeChain(mp, block);
+        return status ? status : -EIO;
+    }
+
+    *newLast = newBlock;
+    return 0;
+}
+
+/* lxfsFallocate(): implementation of fallocate() for lxfs
+ * params: cmd - fallocate command message
+ * returns: nothing, response relayed to kernel
+ */
+
+void lxfsFallocate(FallocateCommand *cmd) {
+    cmd->header.header.response = 1;
+    cmd->header.header.length = sizeof(FallocateCommand);
+
+    Mountpoint *mp = findMP(cmd->device);
+    if(!mp) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    if((cmd->offset < 0) || (cmd->length <= 0)) {
+        cmd->header.header.status = -EINVAL;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    if(cmd->mode & ~FALLOCATE_KEEP_SIZE) {
+        cmd->header.header.status = -EOPNOTSUPP;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    LXFSDirectoryEntry entry;
+    uint64_t dirBlock;
+    off_t dirOffset;
+
+    Handle *handle = lxfsHandleGet(mp, cmd->id, cmd->path);
+    if(handle) {
+        entry.block = handle->file;
+        dirBlock = handle->dirBlock;
+        dirOffset = handle->dirOffset;
+    } else {
+        if(!lxfsFind(&entry, mp, cmd->path, &dirBlock, &dirOffset)) {
+            cmd->header.header.status = -ENOENT;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        uint8_t type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+        if(type != LXFS_DIR_TYPE_FILE) {
+            cmd->header.header.status = (type == LXFS_DIR_TYPE_DIR) ? -EISDIR : -ENODEV;
+            luxSendKernel(cmd);
+            return;
+        }
+    }
+
+    LXFSFileHeader header;
+    Cache *slot = lxfsBorrowBlock(mp, entry.block);
+    if(!slot) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    memcpy(&header, slot->data, sizeof(LXFSFileHeader));
+    lxfsReturnBlock(slot);
+
+    uint64_t first = lxfsNextBlock(mp, entry.block);
+    if(!first) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // files stored inline get a data chain to add the blocks to
+    if(LXFS_INLINE(first, header.size)) {
+        int status = lxfsInlineConvert(mp, entry.block, &header, &first);
+        if(status) {
+            cmd->header.header.status = status;
+            luxSendKernel(cmd);
+            return;
+        }
+    }
+
+    // find the end of the chain, which may already reach past the end of the
+    // file, along with the block the file currently ends in
+    uint64_t end = cmd->offset + cmd->length;
+    uint64_t sizeBlocks = (header.size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    uint64_t count = 0, last = entry.block, sizeBlock = 0;
+
+    for(uint64_t block = first; block != LXFS_BLOCK_EOF; block = lxfsNextBlock(mp, block)) {
+        if(!block || (count >= mp->volumeSize)) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        if(count == (sizeBlocks - 1)) sizeBlock = block;
+        last = block;
+        count++;
+    }
+
+    uint64_t needed = (end + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    if(needed > count) {
+        int status = lxfsPreallocate(mp, entry.block, last, needed - count, &last);
+        if(status) {
+            cmd->header.header.status = status;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        if(first == LXFS_BLOCK_EOF) first = lxfsNextBlock(mp, entry.block);
+        count = needed;
+    }
+
+    if(!(cmd->mode & FALLOCATE_KEEP_SIZE) && (end > header.size)) {
+        // whatever follows the end of the file in its last block must read
+        // as zeroes now that it becomes part of the file
+        uint64_t tail = header.size % mp->blockSizeBytes;
+        if(tail && sizeBlock && !lxfsIsUnwritten(mp, sizeBlock)) {
+            if(lxfsReadBlock(mp, sizeBlock, mp->dataBuffer)) {
+                cmd->header.header.status = -EIO;
+                luxSendKernel(cmd);
+                return;
+            }
+
+            memset(mp->dataBuffer + tail, 0, mp->blockSizeBytes - tail);
+            if(lxfsWriteFileBlock(mp, entry.block, sizeBlock, mp->dataBuffer)) {
+                cmd->header.header.status = -EIO;
+                luxSendKernel(cmd);
+                return;
+            }
+        }
+
+        header.size = end;
+        time_t timestamp = time(NULL);
+        if(lxfsWritePartial(mp, entry.block, entry.block, 0, &header, sizeof(LXFSFileHeader))
+        || lxfsWriteTimestamps(mp, dirBlock, dirOffset, timestamp)) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        lxfsDentryTouch(mp, cmd->path, timestamp, timestamp);
+        sizeBlocks = (header.size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    }
+
+    // the last block of a chain reaching past the end of the file isn't the
+    // one appends go to
+    lxfsChainInvalidate(mp, entry.block);
+    lxfsHandleUpdate(mp, entry.block, &header, first, (count == sizeBlocks) ? last : 0);
+
+    cmd->header.header.status = 0;
+    luxSendKernel(cmd);
+}
@@ -0,0 +1,315 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The block cache is write-back. Every dirty slot is on the dirty list of its
+ * mountpoint, and slots holding file data are additionally on the dirty list
+ * of the file that last wrote them, keyed by the file's header block. Metadata
+ * shared between files - the block table and directories - has no owner, and
+ * file data written to a shared block leaves it shared. Dirty blocks are
+ * written back by the background flusher, which runs when the driver is idle
+ * and after every request that leaves too many of them dirty, by fsync() for
+ * a single file, and on eviction from the cache. A block table mirrored in
+ * memory is written back along with the shared metadata. Creating a file and
+ * fsync() only write back the few table and directory blocks that the file
+ * depends on rather than all of the shared metadata. Freeing a chain drops
+ * its blocks from the cache, so a reused block never carries stale data.
+ */
+
+/* lxfsDirtyFile(): returns the dirty list of a file
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * params: create - create the list if it doesn't exist
+ * returns: pointer to the dirty list, NULL if there is none
+ */
+
+static DirtyFile *lxfsDirtyFile(Mountpoint *mp, uint64_t file, int create) {
+    DirtyFile **bucket = &mp->dirtyFiles[file % DIRTY_BUCKETS];
+    for(DirtyFile *list = *bucket; list; list = list->next) {
+        if(list->file == file) return list;
+    }
+
+    if(!create) return NULL;
+
+    DirtyFile *list = calloc(1, sizeof(DirtyFile));
+    if(!list) return NULL;
+
+    list->file = file;
+    list->next = *bucket;
+    *bucket = list;
+    return list;
+}
+
+/* lxfsDirtyFileRemove(): removes a slot from the dirty list of its file
+ * params: mp - mountpoint
+ * params: slot - cache slot
+ * returns: nothing
+ */
+
+static void lxfsDirtyFileRemove(Mountpoint *mp, Cache *slot) {
+    DirtyFile *list = lxfsDirtyFile(mp, slot->owner, 0);
+    if(list) {
+        if(slot->filePrev) slot->filePrev->fileNext = slot->fileNext;
+        else list->head = slot->fileNext;
+        if(slot->fileNext) slot->fileNext->filePrev = slot->filePrev;
+        list->count--;
+
+        // and free the list itself once it's empty
+        if(!list->count) {
+            DirtyFile **ptr = &mp->dirtyFiles[list->file % DIRTY_BUCKETS];
+            while(*ptr != list) ptr = &(*ptr)->next;
+            *ptr = list->next;
+            free(list);
+        }
+    }
+
+    slot->filePrev = NULL;
+    slot->fileNext = NULL;
+    slot->owner = 0;
+}
+
+/* lxfsMarkDirty(): marks a cache slot as dirty
+ * params: mp - mountpoint
+ * params: slot - cache slot
+ * params: owner - header block of the file writing the block, zero if shared
+ * returns: nothing
+ */
+
+void lxfsMarkDirty(Mountpoint *mp, Cache *slot, uint64_t owner) {
+    if(!slot->dirty) {
+        slot->dirty = 1;
+        slot->owner = 0;
+        slot->dirtyPrev = NULL;
+        slot->dirtyNext = mp->dirtyHead;
+        if(mp->dirtyHead) mp->dirtyHead->dirtyPrev = slot;
+        mp->dirtyHead = slot;
+
+        if(!mp->dirtyCount && !mp->tableDirtyCount) mp->dirtySince = time(NULL);
+        mp->dirtyCount++;
+    } else if(slot->owner == owner) {
+        return;
+    } else if(slot->owner) {
+        // the latest writer is the one whose fsync() must write it back
+        lxfsDirtyFileRemove(mp, slot);
+    } else {
+        return;     // shared metadata stays shared
+    }
+
+    if(!owner) return;
+
+    DirtyFile *list = lxfsDirtyFile(mp, owner, 1);
+    if(!list) return;   // keep it shared if we're out of memory
+
+    slot->owner = owner;
+    slot->filePrev = NULL;
+    slot->fileNext = list->head;
+    if(list->head) list->head->filePrev = slot;
+    list->head = slot;
+    list->count++;
+}
+
+/* lxfsMarkClean(): marks a cache slot as clean after it was written back
+ * params: mp - mountpoint
+ * params: slot - cache slot
+ * returns: nothing
+ */
+
+void lxfsMarkClean(Mountpoint *mp, Cache *slot) {
+    if(!slot->dirty) return;
+    if(slot->owner) lxfsDirtyFileRemove(mp, slot);
+
+    if(slot->dirtyPrev) slot->dirtyPrev->dirtyNext = slot->dirtyNext;
+    else mp->dirtyHead = slot->dirtyNext;
+    if(slot->dirtyNext) slot->dirtyNext->dirtyPrev = slot->dirtyPrev;
+
+    slot->dirtyPrev = NULL;
+    slot->dirtyNext = NULL;
+    slot->dirty = 0;
+    mp->dirtyCount--;
+}
+
+/* compareSlots(): comparison function for sorting slots by block number */
+
+static int compareSlots(const void *a, const void *b) {
+    uint64_t x = (*(Cache **) a)->tag;
+    uint64_t y = (*(Cache **) b)->tag;
+    return (x > y) - (x < y);
+}
+
+/* lxfsFlushSlots(): writes back a set of dirty slots
+ * params: mp - mountpoint
+ * params: slots - array of dirty cache slots, sorted in place
+ * params: count - number of slots
+ * returns: zero on success
+ */
+
+static int lxfsFlushSlots(Mountpoint *mp, Cache **slots, size_t count) {
+    qsort(slots, count, sizeof(Cache *), compareSlots);
+
+    int status = 0;
+    size_t i = 0;
+    while(i < count) {
+        // gather a run of adjacent blocks into a single device write
+        size_t length = 1;
+        while(((i + length) < count) && (length < FLUSH_BATCH)
+        && (slots[i + length]->tag == (slots[i]->tag + length)))
+            length++;
+
+        void *data = slots[i]->data;
+        if(length > 1) {
+            for(size_t j = 0; j < length; j++)
+                memcpy(mp->flushBuffer + (j * mp->blockSizeBytes), slots[i + j]->data, mp->blockSizeBytes);
+            data = mp->flushBuffer;
+        }
+
+        lseek(mp->fd, slots[i]->tag * mp->blockSizeBytes, SEEK_SET);
+        ssize_t s = write(mp->fd, data, length * mp->blockSizeBytes);
+        if(s == (length * mp->blockSizeBytes)) {
+            for(size_t j = 0; j < length; j++)
+                lxfsMarkClean(mp, slots[i + j]);
+
+            mp->flushedBlocks += length;
+            mp->flushWrites++;
+        } else {
+            status = 1;     // leave them dirty and carry on with the rest
+        }
+
+        i += length;
+    }
+
+    return status;
+}
+
+/* lxfsFlushFile(): writes back the dirty data blocks of a file
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * returns: zero on success
+ */
+
+int lxfsFlushFile(Mountpoint *mp, uint64_t file) {
+    DirtyFile *list = lxfsDirtyFile(mp, file, 0);
+    if(!list) return 0;
+
+    Cache **slots = malloc(list->count * sizeof(Cache *));
+    if(!slots) return 1;
+
+    size_t count = 0;
+    for(Cache *slot = list->head; slot; slot = slot->fileNext)
+        slots[count++] = slot;
+
+    // this may free the list
+    int status = lxfsFlushSlots(mp, slots, count);
+    free(slots);
+    return status;
+}
+
+/* lxfsFlushDirty(): writes back dirty blocks of the entire mountpoint
+ * params: mp - mountpoint
+ * params: owned - non-zero to write back file data, zero for shared metadata
+ * returns: zero on success
+ */
+
+static int lxfsFlushDirty(Mountpoint *mp, int owned) {
+    if(!mp->dirtyCount) return 0;
+
+    Cache **slots = malloc(mp->dirtyCount * sizeof(Cache *));
+    if(!slots) return 1;
+
+    size_t count = 0;
+    for(Cache *slot = mp->dirtyHead; slot; slot = slot->dirtyNext) {
+        if((slot->owner != 0) == (owned != 0)) slots[count++] = slot;
+    }
+
+    int status = lxfsFlushSlots(mp, slots, count);
+    free(slots);
+    return status;
+}
+
+/* lxfsFlushMetadata(): writes back the block table and directories
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsFlushMetadata(Mountpoint *mp) {
+    int status = lxfsTableFlush(mp);
+    if(lxfsFlushDirty(mp, 0)) status = 1;
+    return status;
+}
+
+/* lxfsFlushAll(): writes back every dirty block of a mountpoint
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsFlushAll(Mountpoint *mp) {
+    // file data goes first so the metadata never points at stale blocks
+    int status = lxfsFlushDirty(mp, 1);
+    if(lxfsFlushMetadata(mp)) status = 1;
+    return status;
+}
+
+/* lxfsFlushTableEntry(): writes back the block table block holding the entry
+ * of a block, whether it is mirrored in memory or in the cache
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: zero on success
+ */
+
+int lxfsFlushTableEntry(Mountpoint *mp, uint64_t block) {
+    uint64_t tableBlock = block / (mp->blockSizeBytes / 8);
+    if(mp->table) return lxfsTableFlushBlock(mp, tableBlock);
+    return lxfsFlushBlock(mp, tableBlock + 33);
+}
+
+/* lxfsFlushChainTable(): writes back the block table blocks holding the
+ * entries of a chain
+ * params: mp - mountpoint
+ * params: first - first block of the chain
+ * returns: zero on success
+ */
+
+int lxfsFlushChainTable(Mountpoint *mp, uint64_t first) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t count = 0, last = 0;
+    int status = 0;
+
+    for(uint64_t block = first; block && (block != LXFS_BLOCK_EOF) && (count < mp->volumeSize);
+    block = lxfsNextBlock(mp, block)) {
+        // neighbouring blocks mostly share a table block
+        if(!count || ((block / entries) != last)) {
+            if(lxfsFlushTableEntry(mp, block)) status = 1;
+            last = block / entries;
+        }
+
+        count++;
+    }
+
+    return status;
+}
+
+/* lxfsFlushBackground(): writes back every dirty block of a mountpoint once
+ * a quarter of its cache is dirty, or once the oldest dirty block has waited
+ * FLUSH_INTERVAL seconds
+ * params: mp - mountpoint
+ * params: now - current time, zero to only check the number of dirty blocks
+ * returns: nothing
+ */
+
+void lxfsFlushBackground(Mountpoint *mp, time_t now) {
+    uint64_t dirty = mp->dirtyCount + mp->tableDirtyCount;
+    if(!dirty) return;
+    if((dirty < FLUSH_THRESHOLD(mp)) && (!now || ((now - mp->dirtySince) < FLUSH_INTERVAL))) return;
+
+    if(lxfsFlushAll(mp))
+        luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to write back dirty blocks\n", mp->device);
+    else
+        mp->dirtySince = now ? now : time(NULL);
+}
@@ -25,30 +25,72 @@ void lxfsFsync(FsyncCommand *cmd) {
         return;
     }
 
+    // the chain index is only useful while the file is open, and close()
+    // leaves the dirty blocks to the background flusher
+    if(cmd->close) {
+        lxfsChainRelease(mp, cmd->id);
+
+        // and so is the space reserved past the end of the file
+        if(mp->reservedBlocks) {
+            Handle *handle = lxfsHandleGet(mp, cmd->id, cmd->path);
+            LXFSDirectoryEntry entry;
+            if(handle) lxfsReserveRelease(mp, handle->file);
+            else if(lxfsFind(&entry, mp, cmd->path, NULL, NULL)) lxfsReserveRelease(mp, entry.block);
+        }
+
+        lxfsHandleRelease(mp, cmd->id);
+
+        cmd->header.header.status = 0;
+        luxSendKernel(cmd);
+        return;
+    }
+
     LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, cmd->path, NULL, NULL)) {
-        if(!cmd->close) cmd->header.header.status = -ENOENT;
-        else cmd->header.header.status = 0;
+    uint64_t dirBlock = 0;     // the root directory has no entry
+    off_t dirOffset = 0;
+
+    Handle *handle = lxfsHandleGet(mp, cmd->id, cmd->path);
+    if(handle) {
+        entry.block = handle->file;
+        dirBlock = handle->dirBlock;
+        dirOffset = handle->dirOffset;
+    } else if(!lxfsFind(&entry, mp, cmd->path, &dirBlock, &dirOffset)) {
+        cmd->header.header.status = -ENOENT;
         luxSendKernel(cmd);
         return;
     }
 
-    uint64_t next = entry.block;
-    while(next && (next != LXFS_BLOCK_EOF)) {
-        if(lxfsFlushBlock(mp, next)) {
-            cmd->header.header.status = -EIO;
-            luxSendKernel(cmd);
-            return;
+    // write back the file's own data, and then only the block table entries
+    // of its chain and the directory entry that make it reachable
+    int status = lxfsFlushFile(mp, entry.block) || lxfsFlushChainTable(mp, entry.block);
+
+    // directories are shared metadata rather than file data, so they are
+    // written back block by block
+    if(!status && !handle
+    && (((entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) == LXFS_DIR_TYPE_DIR)) {
+        uint64_t count = 0;
+        for(uint64_t block = entry.block; block && (block != LXFS_BLOCK_EOF) && (count < mp->volumeSize);
+        block = lxfsNextBlock(mp, block)) {
+            if(lxfsFlushBlock(mp, block)) status = 1;
+            count++;
         }
+    }
 
-        next = lxfsNextBlock(mp, next);
-        if(!next) {
-            cmd->header.header.status = -EIO;
-            luxSendKernel(cmd);
-            return;
+    // the entry may cross into the next block of its directory
+    if(!status && dirBlock) {
+        status = lxfsFlushBlock(mp, dirBlock);
+        if(!status && ((dirOffset + sizeof(LXFSDirectoryEntry)) > mp->blockSizeBytes)) {
+            uint64_t next = lxfsNextBlock(mp, dirBlock);
+            if(next && (next != LXFS_BLOCK_EOF)) status = lxfsFlushBlock(mp, next);
         }
     }
 
+    if(status) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
     cmd->header.header.status = 0;
     luxSendKernel(cmd);
 }
\ No newline at end of file
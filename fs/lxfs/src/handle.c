@@ -0,0 +1,219 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every file opened on an lxfs volume gets a handle, keyed by the unique ID
+ * the kernel assigns to the open file, which remembers where its directory
+ * entry is along with a copy of its header, its first block and its last
+ * block once that is known. Reads and writes through a handle don't need to
+ * look the file up at all. Handles are only a cache: requests whose ID has
+ * no handle, or whose path doesn't match the one the file was opened by, go
+ * through lxfsFind() as usual. The header copies of every handle on a file
+ * are kept in sync with lxfsHandleUpdate(), and anything that moves a
+ * directory entry or changes a header in any other way must call
+ * lxfsHandleInvalidate().
+ */
+
+/* lxfsHandleFind(): looks up the handle of an open file
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * returns: pointer to the handle, NULL if there is none
+ */
+
+static Handle *lxfsHandleFind(Mountpoint *mp, uint64_t id) {
+    for(Handle *handle = mp->handles[id % HANDLE_BUCKETS]; handle; handle = handle->next) {
+        if(handle->id == id) return handle;
+    }
+
+    return NULL;
+}
+
+/* lxfsHandleOpen(): creates the handle of a newly opened file
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * params: path - path of the file
+ * returns: pointer to the handle, NULL on fail
+ */
+
+Handle *lxfsHandleOpen(Mountpoint *mp, uint64_t id, const char *path) {
+    LXFSDirectoryEntry entry;
+    uint64_t dirBlock;
+    off_t dirOffset;
+    if(!lxfsFind(&entry, mp, path, &dirBlock, &dirOffset)) return NULL;
+
+    Cache *header = lxfsBorrowBlock(mp, entry.block);
+    if(!header) return NULL;
+
+    uint64_t first = lxfsNextBlock(mp, entry.block);
+    if(!first) {
+        lxfsReturnBlock(header);
+        return NULL;
+    }
+
+    // the ID may be reused without the previous file ever being closed
+    Handle *handle = lxfsHandleFind(mp, id);
+    if(!handle) {
+        handle = calloc(1, sizeof(Handle));
+        if(!handle) {
+            lxfsReturnBlock(header);
+            return NULL;
+        }
+
+        handle->id = id;
+        handle->next = mp->handles[id % HANDLE_BUCKETS];
+        mp->handles[id % HANDLE_BUCKETS] = handle;
+    }
+
+    free(handle->path);
+    handle->path = strdup(path);
+    handle->file = entry.block;
+    handle->dirBlock = dirBlock;
+    handle->dirOffset = dirOffset;
+    memcpy(&handle->header, header->data, sizeof(LXFSFileHeader));
+    handle->first = first;
+    handle->tail = 0;
+    lxfsReturnBlock(header);
+
+    if(!handle->path) {
+        lxfsHandleRelease(mp, id);
+        return NULL;
+    }
+
+    return handle;
+}
+
+/* lxfsHandleGet(): returns the handle of an open file
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * params: path - path of the file in the request
+ * returns: pointer to the handle, NULL if there is none
+ */
+
+Handle *lxfsHandleGet(Mountpoint *mp, uint64_t id, const char *path) {
+    Handle *handle = lxfsHandleFind(mp, id);
+    if(!handle || strcmp(handle->path, path)) return NULL;
+    return handle;
+}
+
+/* lxfsHandleRelease(): releases the handle of a closed file
+ * params: mp - mountpoint
+ * params: id - unique ID of the open file
+ * returns: nothing
+ */
+
+void lxfsHandleRelease(Mountpoint *mp, uint64_t id) {
+    Handle **ptr = &mp->handles[id % HANDLE_BUCKETS];
+    while(*ptr) {
+        Handle *handle = *ptr;
+        if(handle->id == id) {
+            *ptr = handle->next;
+            free(handle->path);
+            free(handle);
+            return;
+        }
+
+        ptr = &handle->next;
+    }
+}
+
+/* lxfsHandleUpdate(): updates every handle of a file after it was written
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * params: header - new file header
+ * params: first - first data block of the file
+ * params: tail - last data block of the file, zero if not known
+ * returns: nothing
+ */
+
+void lxfsHandleUpdate(Mountpoint *mp, uint64_t file, const LXFSFileHeader *header,
+                      uint64_t first, uint64_t tail) {
+    for(int i = 0; i < HANDLE_BUCKETS; i++) {
+        for(Handle *handle = mp->handles[i]; handle; handle = handle->next) {
+            if(handle->file != file) continue;
+
+            memcpy(&handle->header, header, sizeof(LXFSFileHeader));
+            handle->first = first;
+            handle->tail = tail;
+        }
+    }
+}
+
+/* lxfsHandleIsOpen(): checks whether a file has any handles
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * returns: non-zero if the file is open
+ */
+
+int lxfsHandleIsOpen(Mountpoint *mp, uint64_t file) {
+    for(int i = 0; i < HANDLE_BUCKETS; i++) {
+        for(Handle *handle = mp->handles[i]; handle; handle = handle->next) {
+            if(handle->file == file) return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* lxfsHandleInvalidate(): discards every handle of a file, so that requests
+ * on it fall back to looking the file up by path
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * returns: nothing
+ */
+
+void lxfsHandleInvalidate(Mountpoint *mp, uint64_t file) {
+    for(int i = 0; i < HANDLE_BUCKETS; i++) {
+        Handle **ptr = &mp->handles[i];
+        while(*ptr) {
+            Handle *handle = *ptr;
+            if(handle->file == file) {
+                *ptr = handle->next;
+                free(handle->path);
+                free(handle);
+                continue;
+            }
+
+            ptr = &handle->next;
+        }
+    }
+}
+
+/* compareBlocks(): comparison function for searching sorted block numbers */
+
+static int compareBlocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* lxfsHandleInvalidateDir(): discards every handle of a file whose directory
+ * entry is in a directory whose entries were moved
+ * params: mp - mountpoint
+ * params: blocks - sorted blocks of the directory
+ * params: count - number of blocks
+ * returns: nothing
+ */
+
+void lxfsHandleInvalidateDir(Mountpoint *mp, const uint64_t *blocks, size_t count) {
+    for(int i = 0; i < HANDLE_BUCKETS; i++) {
+        Handle **ptr = &mp->handles[i];
+        while(*ptr) {
+            Handle *handle = *ptr;
+            if(bsearch(&handle->dirBlock, blocks, count, sizeof(uint64_t), compareBlocks)) {
+                *ptr = handle->next;
+                free(handle->path);
+                free(handle);
+                continue;
+            }
+
+            ptr = &handle->next;
+        }
+    }
+}
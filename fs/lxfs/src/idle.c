@@ -0,0 +1,102 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <time.h>
+
+static time_t lastReport = 0;
+
+/* lxfsReportStatistics(): logs the cache counters of a mountpoint
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+static void lxfsReportStatistics(Mountpoint *mp) {
+    uint64_t accesses = mp->cacheHits + mp->cacheMisses;
+    if(accesses == mp->reportedAccesses) return;   // nothing new to report
+    mp->reportedAccesses = accesses;
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: block cache %d hits, %d misses (%d%% hit rate), %d evictions\n",
+        mp->device, mp->cacheHits, mp->cacheMisses, (mp->cacheHits * 100) / accesses,
+        mp->cacheEvictions);
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: dentry cache %d hits, %d misses\n",
+        mp->device, mp->dentryHits, mp->dentryMisses);
+
+    if(mp->scannedEntries) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: directory scans passed %d entries, %d names compared\n",
+            mp->device, mp->scannedEntries, mp->nameCompares);
+    }
+
+    if(mp->reusedSlots) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: %d creates reused the space of deleted entries\n",
+            mp->device, mp->reusedSlots);
+    }
+
+    if(mp->absorbedAppends) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: %d small appends absorbed, headers written %d times\n",
+            mp->device, mp->absorbedAppends, mp->appendCommits);
+    }
+
+    if(mp->indexLookups) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: %d lookups through directory indexes\n",
+            mp->device, mp->indexLookups);
+    }
+
+    if(mp->flushWrites) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: wrote back %d blocks in %d device writes\n",
+            mp->device, mp->flushedBlocks, mp->flushWrites);
+    }
+
+    if(mp->streamWrites) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: streamed %d blocks past the cache in %d device writes\n",
+            mp->device, mp->streamedBlocks, mp->streamWrites);
+    }
+
+    if(mp->defrag.dir || mp->defrag.count) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: defragmentation looked at %d files so far, moved %d of them (%d blocks)\n",
+            mp->device, mp->defrag.files, mp->defrag.moved, mp->defrag.blocks);
+    }
+
+    if(mp->prefetched) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: read ahead %d blocks, %d used (%d%% hit rate), %d evicted unused\n",
+            mp->device, mp->prefetched, mp->prefetchHits, (mp->prefetchHits * 100) / mp->prefetched,
+            mp->prefetchWasted);
+    }
+
+    lxfsReportFragmentation(mp);
+}
+
+/* lxfsIdle(): performs background housekeeping while no requests are pending
+ * params: none
+ * returns: nothing
+ */
+
+void lxfsIdle() {
+    time_t now = time(NULL);
+
+    for(Mountpoint *mp = mps; mp; mp = mp->next) {
+        // files whose absorbed appends have waited long enough
+        if(lxfsAppendCommitAll(mp, APPEND_DELAY))
+            luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to update files after appending\n", mp->device);
+
+        // directories where deleted entries piled up
+        lxfsCompactPending(mp);
+
+        // background flusher
+        lxfsFlushBackground(mp, now);
+
+        // and a little more of the defragmentation pass, if any
+        lxfsDefragStep(mp);
+    }
+
+    if((now - lastReport) < STATS_INTERVAL) return;
+    lastReport = now;
+
+    for(Mountpoint *mp = mps; mp; mp = mp->next)
+        lxfsReportStatistics(mp);
+}
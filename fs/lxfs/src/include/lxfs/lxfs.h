@@ -8,17 +8,197 @@
 #pragma once
 
 #include <sys/types.h>
+#include <time.h>
 #include <liblux/liblux.h>
 
-/* with a block size of 2 KB, this will give us 8 MB of cache */
+/* default cache capacity in blocks, overridden with the "cache=" mount option;
+ * with a block size of 2 KB, this will give us 8 MB of cache */
 #define CACHE_SIZE          4096
+#define CACHE_WAYS          8       // set associativity
 
-typedef struct {
+/* interval at which cache statistics are logged, in seconds */
+#define STATS_INTERVAL      60
+
+/* default and upper bound of the sequential read-ahead window, in blocks,
+ * the default can be overridden with the "readahead=" mount option */
+#define READAHEAD_DEFAULT   32
+#define READAHEAD_MAX       256
+#define READAHEAD_MIN       4       // initial window on sequential access
+
+typedef struct Cache {
     int valid, dirty;
-    uint64_t tag;
+    int prefetched;             // read ahead and not yet used
+    int pins;                   // borrowers reading the data in place
+    uint64_t tag;               // block number
+    uint64_t lastUsed;          // for LRU replacement within a set
+    uint64_t owner;             // header block of the file that dirtied it,
+                                // zero for metadata shared between files
+    struct Cache *dirtyPrev, *dirtyNext;    // per-mount dirty list
+    struct Cache *filePrev, *fileNext;      // per-file dirty list
     void *data;
 } Cache;
 
+/* dirty blocks are written back in the background once the oldest has been
+ * dirty for FLUSH_INTERVAL seconds or once a quarter of the cache is dirty */
+#define FLUSH_INTERVAL      5
+#define FLUSH_THRESHOLD(mp) (((mp)->cacheSets * (mp)->cacheWays) / 4)
+#define FLUSH_BATCH         64      // max blocks in one coalesced device write
+
+/* runs of at least STREAM_MIN physically contiguous whole blocks in a write
+ * go straight to the device instead of through the cache */
+#define STREAM_MIN          8
+
+/* copy_file_range() moves data through a buffer of up to COPY_BLOCKS blocks */
+#define COPY_BLOCKS         256
+
+/* number of hash buckets for per-file dirty lists */
+#define DIRTY_BUCKETS       64
+
+typedef struct DirtyFile {
+    struct DirtyFile *next;
+    uint64_t file;              // header block of the file
+    Cache *head;
+    size_t count;
+} DirtyFile;
+
+/* number of records in the directory lookup cache */
+#define DENTRY_CACHE_SIZE   1024
+
+/* number of directory listings that can be resumed at once */
+#define READDIR_CURSORS     16
+
+/* number of hash buckets for per-open-file chain indexes */
+#define CHAIN_BUCKETS       64
+
+/* number of hash buckets for the open file handle table */
+#define HANDLE_BUCKETS      64
+
+/* directories get a hash index once they have this many entries, on volumes
+ * with the feature enabled by the dirindex mount option */
+#define INDEX_THRESHOLD     128
+
+/* deleted directory entries are remembered for reuse by creates in up to
+ * SLOT_DIRS directories at a time, DIR_SLOTS entries each, and a directory
+ * is compacted in the background once at least COMPACT_MIN deleted entries
+ * make up half of it */
+#define SLOT_DIRS           16
+#define DIR_SLOTS           32
+#define COMPACT_MIN         64
+
+/* largest block table that the tablemirror mount option keeps in memory,
+ * which covers a 16 GB volume with 2 KB blocks */
+#define TABLE_MIRROR_MAX    (64 << 20)
+
+/* files that grow by appending get up to PREALLOC_BLOCKS blocks following
+ * their last block reserved for the next append, for up to PREALLOC_FILES
+ * files at a time */
+#define PREALLOC_BLOCKS     16
+#define PREALLOC_FILES      32
+
+/* small appends to up to APPEND_FILES open files at a time are absorbed into
+ * their last block in the cache, and their header and timestamps written
+ * once the oldest absorbed append is APPEND_DELAY seconds old */
+#define APPEND_FILES        16
+#define APPEND_DELAY        1
+
+/* the background defragmenter, enabled by the defrag mount option, starts a
+ * pass over the volume every DEFRAG_INTERVAL seconds, and moves up to
+ * DEFRAG_BLOCKS blocks or looks at up to DEFRAG_SCAN directory entries each
+ * time the driver is idle; files larger than DEFRAG_MAX blocks stay put */
+#define DEFRAG_INTERVAL     3600
+#define DEFRAG_BLOCKS       512
+#define DEFRAG_SCAN         128
+#define DEFRAG_MAX          4096
+
+typedef struct {
+    uint64_t file;              // header block of the file, zero if unused
+    uint64_t start, length;
+    uint64_t lastUsed;
+} Reservation;
+
+/* pending update to the block table */
+typedef struct {
+    uint64_t block;
+    uint64_t next;
+} TableEdit;
+
+typedef struct {
+    uint64_t logical;           // first logical block of the run
+    uint64_t physical;          // and the physical block it's stored in
+    uint64_t length;            // in blocks
+} Extent;
+
+typedef struct ChainIndex {
+    struct ChainIndex *next;
+    uint64_t id;                // unique ID of the open file
+    uint64_t file;              // block holding the file header
+    uint64_t first;             // first data block
+    Extent *extents;
+    size_t count, capacity;
+    uint64_t mapped;            // number of logical blocks covered
+
+    /* sequential read-ahead state */
+    uint64_t expected;          // logical block a sequential read would start at
+    uint64_t window;            // current read-ahead window, in blocks
+    uint64_t ahead;             // first logical block not yet read ahead
+} ChainIndex;
+
+typedef struct {
+    uint64_t block;             // block containing the next entry
+    off_t offset;               // and its offset within the block
+    size_t index;               // raw index of the next entry
+    uint64_t next;              // block following the loaded one
+    uint64_t loaded;            // block currently in the data buffer
+    int loadedNext;             // next block also in the data buffer
+} DirPosition;
+
+typedef struct {
+    int valid;
+    char *path;
+    uint64_t dir;               // first block of the directory
+    size_t position;            // readdir() position to resume at
+    DirPosition pos;
+    uint64_t lastUsed;
+} ReaddirCursor;
+
+typedef struct {
+    uint64_t block;             // block containing the deleted entry
+    off_t offset;               // and its offset within the block
+    uint16_t size;
+} FreeSlot;
+
+typedef struct {
+    uint64_t dir;               // first block of the directory, zero if unused
+    FreeSlot slots[DIR_SLOTS];
+    int count;
+    uint64_t deleted;           // entries deleted since the directory was
+    uint64_t deletedBytes;      // last compacted, or since mounting
+    int compact;                // due for compaction
+    uint64_t lastUsed;
+} DirSlots;
+
+typedef struct {
+    uint64_t file;              // header block of the file, zero if unused
+    char *path;                 // path the file was opened by
+    uint64_t dirBlock;          // block containing the directory entry
+    off_t dirOffset;            // and its offset within the block
+    uint64_t size;              // size including the absorbed appends
+    uint64_t first, tail;       // first and last data blocks
+    uint64_t modTime;           // time of the latest absorbed append
+    time_t since;               // time of the oldest absorbed append
+} PendingAppend;
+
+typedef struct {
+    int enabled;
+    uint64_t *stack;            // directories left to visit in this pass
+    size_t count, capacity;
+    uint64_t dir;               // directory being visited, zero if none
+    uint64_t skip;              // entries of it visited so far
+    time_t lastPass;            // when the last pass finished
+    uint64_t files, moved, blocks;
+    uint64_t extents;           // extents at the start of the pass
+} Defrag;
+
 typedef struct Mountpoint {
     struct Mountpoint *next;
     char device[MAX_FILE_PATH];
@@ -27,11 +207,63 @@ typedef struct Mountpoint {
 
     uint64_t volumeSize;        // in blocks
     uint64_t root;              // root directory block
+    uint8_t features;           // LXFS_FEATURE_* of the volume
     void *blockTableBuffer;     // of size blockSizeBytes
     void *dataBuffer;           // of size 2 * blockSizeBytes
     void *meta;                 // metadata buffer, blockSizeBytes
 
     Cache *cache;
+    int cacheSets, cacheWays;
+    uint64_t cacheTick;
+    uint64_t cacheHits, cacheMisses, cacheEvictions;
+    uint64_t reportedAccesses;
+
+    Cache *dirtyHead;
+    uint64_t dirtyCount;
+    time_t dirtySince;          // when the oldest dirty block was dirtied
+    DirtyFile *dirtyFiles[DIRTY_BUCKETS];
+    void *flushBuffer;          // of size FLUSH_BATCH * blockSizeBytes
+    uint64_t flushedBlocks, flushWrites;
+    uint64_t streamedBlocks, streamWrites;
+
+    uint64_t *table;            // in-memory block table, NULL if not mirrored
+    uint64_t tableSize;         // in blocks
+    uint64_t *tableDirty;       // one bit per table block, set if dirty
+    uint64_t tableDirtyCount;
+
+    uint64_t readahead;         // maximum read-ahead window, zero to disable
+    void *prefetchBuffer;       // of size readahead * blockSizeBytes
+    uint64_t prefetched, prefetchHits, prefetchWasted;
+
+    uint64_t *freeMap;          // one bit per block, set if free
+    uint64_t *freeSummary;      // one bit per freeMap word, set if non-zero
+    uint64_t freeBlocks;
+    uint64_t fileCount;         // number of block chains, i.e. files and directories
+    uint64_t fragments;         // links in a chain that aren't to the next block
+
+    Reservation reservations[PREALLOC_FILES];
+    uint64_t reservedBlocks;    // reserved blocks are not counted as free
+    uint64_t reserveTick;
+
+    ChainIndex *chains[CHAIN_BUCKETS];
+    struct Handle *handles[HANDLE_BUCKETS];
+
+    struct Dentry *dentries;
+    uint64_t dentryHits, dentryMisses;
+    uint64_t scannedEntries, nameCompares;
+    uint64_t indexLookups;
+
+    ReaddirCursor cursors[READDIR_CURSORS];
+    uint64_t cursorTick;
+
+    DirSlots dirSlots[SLOT_DIRS];
+    uint64_t slotTick;
+    uint64_t reusedSlots;
+
+    PendingAppend appends[APPEND_FILES];
+    uint64_t absorbedAppends, appendCommits;
+
+    Defrag defrag;
 } Mountpoint;
 
 typedef struct {
@@ -42,7 +274,8 @@ typedef struct {
     uint8_t parameters;
     uint8_t version;
     uint8_t name[16];
-    uint8_t reserved[6];
+    uint8_t features;
+    uint8_t reserved[5];
 
     // more boot code follows
 } __attribute__((packed)) LXFSIdentification;
@@ -56,6 +289,12 @@ typedef struct {
 #define LXFS_ID_BLOCK_SIZE_SHIFT    3
 #define LXFS_ID_BLOCK_SIZE_MASK     0x0F
 
+/* optional features, older drivers leave this byte alone */
+#define LXFS_FEATURE_NAME_HASH      0x01    // entries have been given name hashes
+#define LXFS_FEATURE_DIR_INDEX      0x02    // large directories may have hash indexes
+#define LXFS_FEATURE_INLINE_DATA    0x04    // small files may be stored in their header block
+#define LXFS_FEATURE_UNWRITTEN      0x08    // block table links may be flagged as unwritten
+
 typedef struct {
     uint32_t identifier;
     uint32_t cpuArch;
@@ -75,15 +314,53 @@ typedef struct {
 #define LXFS_BLOCK_TABLE            0xFFFFFFFFFFFFFFFE
 #define LXFS_BLOCK_EOF              0xFFFFFFFFFFFFFFFF
 
+/* blocks allocated for a gap left by writing past the end of a file are
+ * flagged in the block table entry linking them to the next block, and read
+ * as zeroes until data is first written to them; the last block of a chain
+ * is never unwritten, and volumes with such links are marked with
+ * LXFS_FEATURE_UNWRITTEN */
+#define LXFS_BLOCK_UNWRITTEN        0x4000000000000000
+#define LXFS_UNWRITTEN(n)           (((n) < LXFS_BLOCK_ID) && ((n) & LXFS_BLOCK_UNWRITTEN))
+#define LXFS_NEXT(n)                (LXFS_UNWRITTEN(n) ? ((n) & ~LXFS_BLOCK_UNWRITTEN) : (n))
+
+/* true if a block links to another block that doesn't directly follow it */
+#define LXFS_FRAGMENTED(b, n)       (((n) != LXFS_BLOCK_FREE) && ((n) < LXFS_BLOCK_ID) && (LXFS_NEXT(n) != ((b) + 1)))
+
 typedef struct {
     uint64_t createTime;
     uint64_t modTime;
     uint64_t accessTime;
     uint64_t sizeEntries;
     uint64_t sizeBytes;
-    uint64_t reserved;
+    uint64_t index;             // first block of the hash index, zero for none
 } __attribute__((packed)) LXFSDirectoryHeader;
 
+/* directories with many entries can have a hash index, a contiguous chain of
+ * one header block followed by a power of two number of bucket blocks, each
+ * holding the hash and location of the entries that fall into it; the
+ * directory itself is still a complete linear list for older drivers */
+typedef struct {
+    uint32_t identifier;
+    uint32_t buckets;
+    uint64_t sizeEntries;       // directory header counts as of the last update
+    uint64_t sizeBytes;         // by this driver, to notice changes by others
+    uint64_t endBlock;          // where the next entry will be appended
+    uint64_t endOffset;
+} __attribute__((packed)) LXFSIndexHeader;
+
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;
+} __attribute__((packed)) LXFSIndexBucket;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t offset;            // of the entry within its block
+    uint64_t block;
+} __attribute__((packed)) LXFSIndexSlot;
+
+#define LXFS_INDEX_MAGIC            0x5844494C  // 'LIDX', little endian
+
 typedef struct {
     uint16_t flags;
 
@@ -98,10 +375,22 @@ typedef struct {
 
     uint64_t block;
     uint16_t entrySize;
-    uint8_t reserved[14];
+    uint32_t nameHash;          // zero in entries written by older drivers
+    uint8_t reserved[10];
     uint8_t name[512];
 } __attribute__((packed)) LXFSDirectoryEntry;
 
+typedef struct Dentry {
+    int valid, negative;
+    uint64_t hash;
+    uint64_t parent;            // directory block, zero for full paths
+    char *name;                 // file name or full path
+    uint64_t dir;               // directory the entry was found in
+    uint64_t block;             // block containing the entry
+    off_t offset;               // and its offset within that block
+    LXFSDirectoryEntry entry;
+} Dentry;
+
 #define LXFS_DIR_VALID              0x0001
 #define LXFS_DIR_TYPE_SHIFT         1
 #define LXFS_DIR_TYPE_MASK          0x03
@@ -127,31 +416,149 @@ typedef struct {
     uint64_t refCount;
 } __attribute__((packed)) LXFSFileHeader;
 
+/* small files can have their contents stored right after the header, in
+ * which case the header block is the only block of the file */
+#define LXFS_INLINE_MAX(mp)         ((mp)->blockSizeBytes - sizeof(LXFSFileHeader))
+#define LXFS_INLINE(first, size)    (((first) == LXFS_BLOCK_EOF) && (size))
+
+typedef struct Handle {
+    struct Handle *next;
+    uint64_t id;                // unique ID of the open file
+    char *path;                 // path the file was opened by
+    uint64_t file;              // block holding the file header
+    uint64_t dirBlock;          // block containing the directory entry
+    off_t dirOffset;            // and its offset within the block
+    LXFSFileHeader header;      // copy of the file header
+    uint64_t first;             // first data block
+    uint64_t tail;              // last data block, zero if not known yet
+} Handle;
+
+extern Mountpoint *mps;
+
 void lxfsMount(MountCommand *);
+void lxfsIdle();
+int lxfsCacheInit(Mountpoint *, uint64_t);
 int lxfsFlushSlot(Mountpoint *, uint64_t);
 int lxfsFlushBlock(Mountpoint *, uint64_t);
+void lxfsMarkDirty(Mountpoint *, Cache *, uint64_t);
+void lxfsMarkClean(Mountpoint *, Cache *);
+int lxfsFlushFile(Mountpoint *, uint64_t);
+int lxfsFlushMetadata(Mountpoint *);
+int lxfsFlushAll(Mountpoint *);
+int lxfsFlushTableEntry(Mountpoint *, uint64_t);
+int lxfsFlushChainTable(Mountpoint *, uint64_t);
+void lxfsFlushBackground(Mountpoint *, time_t);
 int lxfsReadBlock(Mountpoint *, uint64_t, void *);
+Cache *lxfsBorrowBlock(Mountpoint *, uint64_t);
+void lxfsReturnBlock(Cache *);
+int lxfsReadBlocks(Mountpoint *, uint64_t, uint64_t, void *);
+int lxfsReadBlocksDirect(Mountpoint *, uint64_t, uint64_t, void *);
+void lxfsCacheDrop(Mountpoint *, uint64_t);
 int lxfsWriteBlock(Mountpoint *, uint64_t, const void *);
+int lxfsWriteFileBlock(Mountpoint *, uint64_t, uint64_t, const void *);
+int lxfsWritePartial(Mountpoint *, uint64_t, uint64_t, off_t, const void *, size_t);
 uint64_t lxfsNextBlock(Mountpoint *, uint64_t);
+int lxfsIsUnwritten(Mountpoint *, uint64_t);
 uint64_t lxfsReadNextBlock(Mountpoint *, uint64_t, void *);
+uint64_t lxfsReadChain(Mountpoint *, uint64_t *, uint64_t, void *);
+int lxfsPrefetchBlocks(Mountpoint *, uint64_t, uint64_t);
+int lxfsStreamBlocks(Mountpoint *, uint64_t, uint64_t, const void *);
+uint64_t lxfsWriteChain(Mountpoint *, uint64_t, uint64_t *, uint64_t, const void *, uint64_t *);
 uint64_t lxfsWriteNextBlock(Mountpoint *, uint64_t, const void *);
-uint64_t lxfsFindFreeBlock(Mountpoint *, uint64_t);
+uint64_t lxfsWriteNextFileBlock(Mountpoint *, uint64_t, uint64_t, const void *);
 int lxfsSetNextBlock(Mountpoint *, uint64_t, uint64_t);
-uint64_t lxfsAllocate(Mountpoint *, uint64_t);
+int lxfsSetNextBlocks(Mountpoint *, TableEdit *, size_t);
+int lxfsFreeChain(Mountpoint *, uint64_t);
 uint64_t lxfsGetBlock(Mountpoint *, uint64_t, uint64_t);
 
+int lxfsInlineRead(Mountpoint *, uint64_t, off_t, size_t, void *);
+int lxfsInlineWrite(Mountpoint *, uint64_t, LXFSFileHeader *, off_t, const void *, size_t);
+int lxfsInlineConvert(Mountpoint *, uint64_t, const LXFSFileHeader *, uint64_t *);
+
+int lxfsTableInit(Mountpoint *);
+void lxfsTableMarkDirty(Mountpoint *, uint64_t);
+int lxfsTableFlush(Mountpoint *);
+int lxfsTableFlushBlock(Mountpoint *, uint64_t);
+
+int lxfsBitmapInit(Mountpoint *);
+void lxfsMarkBlock(Mountpoint *, uint64_t, int);
+int lxfsIsFree(Mountpoint *, uint64_t);
+uint64_t lxfsNextFree(Mountpoint *, uint64_t);
+uint64_t lxfsFreeRun(Mountpoint *, uint64_t, uint64_t);
+uint64_t lxfsFindFreeBlock(Mountpoint *, uint64_t);
+uint64_t lxfsAllocate(Mountpoint *, uint64_t, uint64_t, uint64_t);
+void lxfsReserveRelease(Mountpoint *, uint64_t);
+void lxfsReserveReleaseAll(Mountpoint *);
+uint64_t lxfsAllocateRun(Mountpoint *, uint64_t, uint64_t);
+void lxfsReportFragmentation(Mountpoint *);
+
+ChainIndex *lxfsChainIndex(Mountpoint *, uint64_t, uint64_t, uint64_t);
+uint64_t lxfsChainLookup(Mountpoint *, ChainIndex *, uint64_t);
+void lxfsChainRelease(Mountpoint *, uint64_t);
+void lxfsChainInvalidate(Mountpoint *, uint64_t);
+void lxfsReadahead(Mountpoint *, ChainIndex *, uint64_t, uint64_t);
+
+Handle *lxfsHandleOpen(Mountpoint *, uint64_t, const char *);
+Handle *lxfsHandleGet(Mountpoint *, uint64_t, const char *);
+void lxfsHandleRelease(Mountpoint *, uint64_t);
+void lxfsHandleUpdate(Mountpoint *, uint64_t, const LXFSFileHeader *, uint64_t, uint64_t);
+void lxfsHandleInvalidate(Mountpoint *, uint64_t);
+void lxfsHandleInvalidateDir(Mountpoint *, const uint64_t *, size_t);
+int lxfsHandleIsOpen(Mountpoint *, uint64_t);
+
+int lxfsAppendAbsorb(Mountpoint *, Handle *, off_t, const void *, size_t);
+int lxfsAppendCommit(Mountpoint *, uint64_t);
+int lxfsAppendCommitAll(Mountpoint *, time_t);
+int lxfsWriteTimestamps(Mountpoint *, uint64_t, off_t, uint64_t);
+
 Mountpoint *findMP(const char *);
 int pathDepth(const char *);
 char *pathComponent(char *, const char *, int);
 LXFSDirectoryEntry *lxfsFind(LXFSDirectoryEntry *, Mountpoint *, const char *, uint64_t *, off_t *);
+uint32_t lxfsNameHash(const char *);
+int lxfsNameHashUpgrade(Mountpoint *);
+int lxfsSetFeatures(Mountpoint *, uint8_t);
 int lxfsCreate(LXFSDirectoryEntry *, Mountpoint *, const char *, mode_t, uid_t, gid_t, ...);
+int lxfsAppendEntry(Mountpoint *, uint64_t, off_t, const LXFSDirectoryEntry *);
+
+void lxfsSlotRelease(Mountpoint *, uint64_t, uint64_t, off_t, uint16_t, uint64_t);
+int lxfsSlotFill(Mountpoint *, uint64_t, off_t, uint16_t, const LXFSDirectoryEntry *);
+int lxfsSlotReuse(Mountpoint *, uint64_t, const LXFSDirectoryEntry *);
+void lxfsSlotsDrop(Mountpoint *, uint64_t);
+int lxfsCompact(Mountpoint *, uint64_t);
+void lxfsCompactPending(Mountpoint *);
+
+void lxfsDefragStep(Mountpoint *);
+void lxfsDefragForget(Mountpoint *, uint64_t);
+
+int lxfsDentryInit(Mountpoint *);
+Dentry *lxfsDentryLookup(Mountpoint *, uint64_t, const char *);
+void lxfsDentryInsert(Mountpoint *, uint64_t, const char *, uint64_t, const LXFSDirectoryEntry *, uint64_t, off_t);
+void lxfsDentryInvalidate(Mountpoint *, const char *);
+void lxfsDentryUpdate(Mountpoint *, const char *, const LXFSDirectoryEntry *);
+void lxfsDentryTouch(Mountpoint *, const char *, uint64_t, uint64_t);
+void lxfsDentryInvalidateDir(Mountpoint *, uint64_t);
+
+int lxfsIndexBuild(Mountpoint *, uint64_t, uint32_t);
+int lxfsIndexLookup(Mountpoint *, uint64_t, const char *, uint32_t, LXFSDirectoryEntry **, uint64_t *, off_t *);
+int lxfsIndexAppend(Mountpoint *, uint64_t, const LXFSDirectoryEntry *);
+void lxfsIndexRemove(Mountpoint *, uint64_t, uint32_t, uint64_t, off_t);
+void lxfsIndexDrop(Mountpoint *, uint64_t);
+
+LXFSDirectoryEntry *lxfsReadEntry(Mountpoint *, DirPosition *);
+LXFSDirectoryEntry *lxfsEntryAt(Mountpoint *, uint64_t, off_t);
+void lxfsReaddirInvalidate(Mountpoint *, uint64_t);
+int lxfsStatEntry(Mountpoint *, LXFSDirectoryEntry *, struct stat *);
 
 void lxfsOpen(OpenCommand *);
 void lxfsStat(StatCommand *);
 void lxfsRead(RWCommand *);
 void lxfsWrite(RWCommand *);
+int lxfsWriteData(RWCommand *);
+int lxfsZeroChain(Mountpoint *, uint64_t, uint64_t, uint64_t, uint64_t *);
 void lxfsOpendir(OpendirCommand *);
 void lxfsReaddir(ReaddirCommand *);
+void lxfsGetdents(GetdentsCommand *);
 void lxfsChmod(ChmodCommand *);
 void lxfsChown(ChownCommand *);
 void lxfsMmap(MmapCommand *);
@@ -163,3 +570,5 @@ void lxfsUnlink(UnlinkCommand *);
 void lxfsReadLink(ReadLinkCommand *);
 void lxfsFsync(FsyncCommand *);
 void lxfsStatvfs(StatvfsCommand *);
+void lxfsFallocate(FallocateCommand *);
+void lxfsCopyRange(CopyRangeCommand *);
@@ -0,0 +1,103 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* On volumes with LXFS_FEATURE_INLINE_DATA, files of up to LXFS_INLINE_MAX
+ * bytes keep their contents in the block holding their header, right after
+ * it, so that reading or writing them only ever touches that one block. Such
+ * files have no data chain at all, which is how they are told apart from
+ * chained files: the header block ends its own chain like that of an empty
+ * file, but the size isn't zero. A file is moved to a data chain of its own
+ * the first time a write doesn't fit, and stays chained from then on.
+ */
+
+/* lxfsInlineRead(): reads from a file stored inline
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * params: position - offset within the file
+ * params: length - number of bytes to read, within the size of the file
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsInlineRead(Mountpoint *mp, uint64_t file, off_t position, size_t length, void *buffer) {
+    if((position + length) > LXFS_INLINE_MAX(mp)) return 1;
+
+    Cache *slot = lxfsBorrowBlock(mp, file);
+    if(!slot) return 1;
+
+    memcpy(buffer, slot->data + sizeof(LXFSFileHeader) + position, length);
+    lxfsReturnBlock(slot);
+    return 0;
+}
+
+/* lxfsInlineWrite(): writes to a file stored inline, or to an empty file
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * params: metadata - file header, its size is updated
+ * params: position - offset within the file, may be past its end
+ * params: data - data to write
+ * params: length - number of bytes to write, ending within LXFS_INLINE_MAX
+ * returns: zero on success
+ */
+
+int lxfsInlineWrite(Mountpoint *mp, uint64_t file, LXFSFileHeader *metadata,
+                    off_t position, const void *data, size_t length) {
+    if((position + length) > LXFS_INLINE_MAX(mp)) return 1;
+    if(lxfsReadBlock(mp, file, mp->dataBuffer)) return 1;
+
+    // anything between the old end of the file and the write reads as zeroes
+    void *contents = mp->dataBuffer + sizeof(LXFSFileHeader);
+    if(position > metadata->size)
+        memset(contents + metadata->size, 0, position - metadata->size);
+
+    memcpy(contents + position, data, length);
+    if((position + length) > metadata->size) metadata->size = position + length;
+
+    // the header and the contents go out together in a single block
+    memcpy(mp->dataBuffer, metadata, sizeof(LXFSFileHeader));
+    return lxfsWriteFileBlock(mp, file, file, mp->dataBuffer);
+}
+
+/* lxfsInlineConvert(): moves the contents of a file stored inline into a
+ * data chain, before a write that doesn't fit inline
+ * params: mp - mountpoint
+ * params: file - block holding the file header
+ * params: metadata - file header
+ * params: first - pointer to store the first data block of the file
+ * returns: zero on success, negative errno error code on fail
+ */
+
+int lxfsInlineConvert(Mountpoint *mp, uint64_t file, const LXFSFileHeader *metadata, uint64_t *first) {
+    if(metadata->size > LXFS_INLINE_MAX(mp)) return -EIO;
+
+    uint64_t block = lxfsAllocate(mp, 1, file, file);
+    if(!block) return -ENOSPC;
+
+    // the contents move to the start of the new block, followed by zeroes
+    void *data = mp->dataBuffer + mp->blockSizeBytes;
+    if(lxfsReadBlock(mp, file, mp->dataBuffer)) {
+        lxfsSetNextBlock(mp, block, LXFS_BLOCK_FREE);
+        return -EIO;
+    }
+
+    memcpy(data, mp->dataBuffer + sizeof(LXFSFileHeader), metadata->size);
+    memset(data + metadata->size, 0, mp->blockSizeBytes - metadata->size);
+
+    // the data must be in place before the header points to it
+    if(lxfsWriteFileBlock(mp, file, block, data) || lxfsSetNextBlock(mp, file, block)) {
+        lxfsSetNextBlock(mp, block, LXFS_BLOCK_FREE);
+        return -EIO;
+    }
+
+    *first = block;
+    return 0;
+}
@@ -141,6 +141,9 @@ void lxfsUnlink(UnlinkCommand *cmd) {
     dir->owner = 0;
     dir->group = 0;
     memset(dir->name, 0, dir->entrySize - offsetof(LXFSDirectoryEntry, name));
+    lxfsDentryInvalidate(mp, cmd->path);
+    lxfsHandleInvalidate(mp, entry.block);
+
     uint64_t next = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
     if(!next) {
         cmd->header.header.status = -EIO;
@@ -181,30 +184,28 @@ void lxfsUnlink(UnlinkCommand *cmd) {
             lxfsFlushBlock(mp, entry.block);
         } else {
             // last reference deleted, free up all blocks used by the file
-            uint64_t prev = entry.block;
-            while(prev && prev != LXFS_BLOCK_EOF) {
-                next = lxfsNextBlock(mp, prev);
-                if(lxfsSetNextBlock(mp, prev, 0)) {
-                    cmd->header.header.status = -EIO;
-                    luxSendKernel(cmd);
-                    return;
-                }
-
-                prev = next;
-            }
-        }
-    } else {
-        // for symbolic links and directories, free up the blocks
-        uint64_t prev = entry.block;
-        while(prev && prev != LXFS_BLOCK_EOF) {
-            next = lxfsNextBlock(mp, prev);
-            if(lxfsSetNextBlock(mp, prev, 0)) {
+            lxfsChainInvalidate(mp, entry.block);
+            lxfsReserveRelease(mp, entry.block);
+
+            if(lxfsFreeChain(mp, entry.block)) {
                 cmd->header.header.status = -EIO;
                 luxSendKernel(cmd);
                 return;
             }
+        }
+    } else {
+        // for symbolic links and directories, free up the blocks, including
+        // those of a directory's index
+        if(type == LXFS_DIR_TYPE_DIR) {
+            lxfsIndexDrop(mp, entry.block);
+            lxfsSlotsDrop(mp, entry.block);
+            lxfsDefragForget(mp, entry.block);
+        }
 
-            prev = next;
+        if(lxfsFreeChain(mp, entry.block)) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
         }
     }
 
@@ -245,6 +246,10 @@ void lxfsUnlink(UnlinkCommand *cmd) {
         free(parentPath);
     }
 
+    lxfsReaddirInvalidate(mp, parent.block);
+    lxfsIndexRemove(mp, parent.block, entry.nameHash ? entry.nameHash : lxfsNameHash((const char *) entry.name),
+                    block, offset);
+
     if(lxfsReadBlock(mp, parent.block, mp->meta)) {
         cmd->header.header.status = -EIO;
         luxSendKernel(cmd);
@@ -264,6 +269,10 @@ void lxfsUnlink(UnlinkCommand *cmd) {
     }
 
     lxfsFlushBlock(mp, parent.block);
+
+    // the space of the entry can now be reused by creates
+    lxfsSlotRelease(mp, parent.block, block, offset, entry.entrySize, parentHeader->sizeBytes);
+
     cmd->header.header.status = 0;
     luxSendKernel(cmd);
 }
@@ -48,6 +48,15 @@ int main() {
         // handle requests here
         ssize_t s = luxRecvCommand((void **) &msg);
         if(s > 0) {
+            // appends absorbed through handles must be written out before
+            // anything other than reads and writes can see the files
+            if((msg->header.command != COMMAND_READ) && (msg->header.command != COMMAND_WRITE)) {
+                for(Mountpoint *mp = mps; mp; mp = mp->next) {
+                    if(lxfsAppendCommitAll(mp, 0))
+                        luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to update files after appending\n", mp->device);
+                }
+            }
+
             switch(msg->header.command) {
             case COMMAND_MOUNT: lxfsMount((MountCommand *) msg); break;
             case COMMAND_OPEN: lxfsOpen((OpenCommand *) msg); break;
@@ -56,6 +65,7 @@ int main() {
             case COMMAND_STAT: lxfsStat((StatCommand *) msg); break;
             case COMMAND_OPENDIR: lxfsOpendir((OpendirCommand *) msg); break;
             case COMMAND_READDIR: lxfsReaddir((ReaddirCommand *) msg); break;
+            case COMMAND_GETDENTS: lxfsGetdents((GetdentsCommand *) msg); break;
             case COMMAND_MMAP: lxfsMmap((MmapCommand *) msg); break;
             case COMMAND_CHMOD: lxfsChmod((ChmodCommand *) msg); break;
             case COMMAND_CHOWN: lxfsChown((ChownCommand *) msg); break;
@@ -67,12 +77,19 @@ int main() {
             case COMMAND_READLINK: lxfsReadLink((ReadLinkCommand *) msg); break;
             case COMMAND_FSYNC: lxfsFsync((FsyncCommand *) msg); break;
             case COMMAND_STATVFS: lxfsStatvfs((StatvfsCommand *) msg); break;
+            case COMMAND_FALLOCATE: lxfsFallocate((FallocateCommand *) msg); break;
+            case COMMAND_COPY_RANGE: lxfsCopyRange((CopyRangeCommand *) msg); break;
             default:
                 msg->header.response = 1;
                 msg->header.status = -ENOSYS;
                 luxSendKernel(msg);
             }
+
+            // don't let dirty blocks pile up under sustained traffic
+            for(Mountpoint *mp = mps; mp; mp = mp->next)
+                lxfsFlushBackground(mp, 0);
         } else {
+            lxfsIdle();
             sched_yield();
         }
     }
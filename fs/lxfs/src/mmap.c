@@ -31,28 +31,44 @@ void lxfsMmap(MmapCommand *cmd) {
         return;
     }
 
-    // and the file entry
-    LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, cmd->path, NULL, NULL)) {
-        cmd->header.header.status = -ENOENT;
-        luxSendKernel(cmd);
-        return;
-    }
+    // and the file, straight from its handle if it is open
+    uint64_t file, size, first;
+    Handle *handle = lxfsHandleGet(mp, cmd->id, cmd->path);
+    if(handle) {
+        file = handle->file;
+        size = handle->header.size;
+        first = handle->first;
+    } else {
+        LXFSDirectoryEntry entry;
+        if(!lxfsFind(&entry, mp, cmd->path, NULL, NULL)) {
+            cmd->header.header.status = -ENOENT;
+            luxSendKernel(cmd);
+            return;
+        }
 
-    // use the file entry to read metadata as well as find the first file block
-    uint64_t first = lxfsReadNextBlock(mp, entry.block, mp->meta);
-    if(!first) {
-        cmd->header.header.status = -EIO;
-        luxSendKernel(cmd);
-        return;
-    }
+        // use the file entry to read metadata as well as find the first file
+        // block, reading the header in place in the cache
+        Cache *header = lxfsBorrowBlock(mp, entry.block);
+        if(!header) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
+        }
 
-    LXFSFileHeader *metadata = (LXFSFileHeader *) mp->meta;
+        file = entry.block;
+        size = ((LXFSFileHeader *) header->data)->size;
+        lxfsReturnBlock(header);
 
-    if(cmd->len > metadata->size)
-        cmd->len = metadata->size;
+        first = lxfsNextBlock(mp, entry.block);
+        if(!first) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
+        }
+    }
 
-    size_t blockCount = (cmd->len+mp->blockSizeBytes-1) / mp->blockSizeBytes;
+    if(cmd->len > size)
+        cmd->len = size;
 
     MmapCommand *res = calloc(1, sizeof(MmapCommand) + cmd->len);
     if(!res) {
@@ -65,27 +81,51 @@ void lxfsMmap(MmapCommand *cmd) {
     res->responseType = 0;
     res->mmio = 0;
 
+    // small files are copied straight from the block holding their header
+    if(LXFS_INLINE(first, size)) {
+        if(lxfsInlineRead(mp, file, 0, cmd->len, res->data))
+            res->header.header.status = -EIO;
+        else
+            res->header.header.length += cmd->len;
+
+        luxSendKernel(res);
+        free(res);
+        return;
+    }
+
+    // whole blocks are read straight into the response, with physically
+    // contiguous runs of the chain coalesced into single device reads
     uint64_t block = first;
-    void *position = (void *) res->data;
-    size_t remaining = cmd->len;
-    for(size_t i = 0; i < blockCount; i++) {
-        block = lxfsReadNextBlock(mp, block, mp->dataBuffer);
-        if(!block) {
+    size_t fullBlocks = cmd->len / mp->blockSizeBytes;
+    if(lxfsReadChain(mp, &block, fullBlocks, res->data) != fullBlocks) {
+        res->header.header.status = -EIO;
+        luxSendKernel(res);
+        free(res);
+        return;
+    }
+
+    // and the partial block at the end
+    size_t remaining = cmd->len - (fullBlocks * mp->blockSizeBytes);
+    if(remaining) {
+        int unwritten = 0;
+        Cache *slot = NULL;
+        if(block && (block != LXFS_BLOCK_EOF)) {
+            unwritten = lxfsIsUnwritten(mp, block);
+            if(!unwritten) slot = lxfsBorrowBlock(mp, block);
+        }
+
+        if(!unwritten && !slot) {
             res->header.header.status = -EIO;
             luxSendKernel(res);
             free(res);
             return;
         }
 
-        if(remaining >= mp->blockSizeBytes)
-            memcpy(position, mp->dataBuffer, mp->blockSizeBytes);
-        else
-            memcpy(position, mp->dataBuffer, remaining);
-        
-        remaining -= mp->blockSizeBytes;
-
-        if(block == LXFS_BLOCK_EOF) break;
-        position = (void *)(uintptr_t) position + mp->blockSizeBytes;
+        // the response is zeroed already, so holes in sparse files need no copy
+        if(slot) {
+            memcpy((void *)((uintptr_t)res->data + (fullBlocks * mp->blockSizeBytes)), slot->data, remaining);
+            lxfsReturnBlock(slot);
+        }
     }
 
     res->header.header.length += cmd->len;
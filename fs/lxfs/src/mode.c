@@ -56,6 +56,7 @@ void lxfsChmod(ChmodCommand *cmd) {
     if(cmd->mode & S_IROTH) dir->permissions |= LXFS_PERMS_OTHER_R;
     if(cmd->mode & S_IWOTH) dir->permissions |= LXFS_PERMS_OTHER_W;
     if(cmd->mode & S_IXOTH) dir->permissions |= LXFS_PERMS_OTHER_X;
+    lxfsDentryUpdate(mp, cmd->path, dir);
 
     uint64_t next = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
     if(!next) {
@@ -123,6 +124,7 @@ void lxfsChown(ChownCommand *cmd) {
     LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
     if(cmd->newUid != -1) dir->owner = cmd->newUid;
     if(cmd->newGid != -1) dir->group = cmd->newGid;
+    lxfsDentryUpdate(mp, cmd->path, dir);
 
     uint64_t next = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
     if(!next) {
@@ -190,6 +192,7 @@ void lxfsUtime(UtimeCommand *cmd) {
     LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
     dir->accessTime = cmd->accessTime;
     dir->modTime = cmd->modifiedTime;
+    lxfsDentryUpdate(mp, cmd->path, dir);
 
     uint64_t next = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
     if(!next) {
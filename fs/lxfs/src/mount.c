@@ -14,14 +14,39 @@
 #include <unistd.h>
 #include <errno.h>
 
-static Mountpoint *mps = NULL;
+Mountpoint *mps = NULL;
 
-static Mountpoint *allocateMP() {
+typedef struct {
+    uint64_t cache;             // block cache capacity in blocks
+    uint64_t readahead;
+    int dirindex, tablemirror, inlinedata, defrag;
+} MountOptions;
+
+static Mountpoint *allocateMP(int fd, uint64_t volumeSize, int blockSizeBytes, void *blockTableBuffer, uint64_t cacheSize) {
     Mountpoint *mp = calloc(1, sizeof(Mountpoint));
     if(!mp) return NULL;
 
-    mp->cache = calloc(CACHE_SIZE, sizeof(Cache));
-    if(!mp->cache) {
+    mp->fd = fd;
+    mp->volumeSize = volumeSize;
+    mp->blockSizeBytes = blockSizeBytes;
+    mp->blockTableBuffer = blockTableBuffer;
+    if(lxfsCacheInit(mp, cacheSize)) {
+        free(mp);
+        return NULL;
+    }
+
+    if(lxfsBitmapInit(mp)) {
+        free(mp->flushBuffer);
+        free(mp->cache);
+        free(mp);
+        return NULL;
+    }
+
+    if(lxfsDentryInit(mp)) {
+        free(mp->freeMap);
+        free(mp->freeSummary);
+        free(mp->flushBuffer);
+        free(mp->cache);
         free(mp);
         return NULL;
     }
@@ -38,6 +63,104 @@ static Mountpoint *allocateMP() {
     return mp;
 }
 
+/* parseOptions(): reads the lxfs-specific mount options
+ * params: opts - structure to store the options in
+ * params: cmd - mount command message
+ * returns: nothing
+ */
+
+static void parseOptions(MountOptions *opts, MountCommand *cmd) {
+    memset(opts, 0, sizeof(MountOptions));
+    opts->cache = CACHE_SIZE;
+    opts->readahead = READAHEAD_DEFAULT;
+
+    // older requests don't carry any options at all
+    if(cmd->header.header.length >= sizeof(MountCommand)) {
+        char options[sizeof(cmd->options)];
+        memcpy(options, cmd->options, sizeof(options));
+        options[sizeof(options)-1] = 0;
+
+        char *saveptr;
+        for(char *opt = strtok_r(options, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr)) {
+            if(!strncmp(opt, "readahead=", 10)) opts->readahead = strtoul(opt+10, NULL, 10);
+            else if(!strncmp(opt, "cache=", 6)) opts->cache = strtoul(opt+6, NULL, 10);
+            else if(!strcmp(opt, "dirindex")) opts->dirindex = 1;
+            else if(!strcmp(opt, "tablemirror")) opts->tablemirror = 1;
+            else if(!strcmp(opt, "inline")) opts->inlinedata = 1;
+            else if(!strcmp(opt, "defrag")) opts->defrag = 1;
+            else luxLogf(KPRINT_LEVEL_WARNING, "ignoring unknown mount option '%s' on %s\n", opt, cmd->source);
+        }
+    }
+
+    // at least one full set
+    if(opts->cache < CACHE_WAYS) opts->cache = CACHE_WAYS;
+}
+
+/* applyOptions(): applies the lxfs-specific mount options once the volume
+ * and its cache are set up
+ * params: mp - mountpoint
+ * params: opts - mount options
+ * params: cmd - mount command message
+ * returns: nothing
+ */
+
+static void applyOptions(Mountpoint *mp, MountOptions *opts, MountCommand *cmd) {
+    mp->readahead = opts->readahead;
+    mp->defrag.enabled = opts->defrag;
+
+    // don't let read-ahead flush out the rest of the cache
+    if(mp->readahead > READAHEAD_MAX) mp->readahead = READAHEAD_MAX;
+    if(mp->readahead > ((mp->cacheSets * mp->cacheWays) / 4))
+        mp->readahead = (mp->cacheSets * mp->cacheWays) / 4;
+
+    if(mp->readahead) {
+        mp->prefetchBuffer = malloc(mp->readahead * mp->blockSizeBytes);
+        if(!mp->prefetchBuffer) mp->readahead = 0;
+    }
+
+    // keep the block table in memory if it fits, and use the cache if not
+    if(opts->tablemirror && lxfsTableInit(mp))
+        luxLogf(KPRINT_LEVEL_WARNING, "not enough memory to keep the block table of %s, using the cache\n", cmd->source);
+
+    // directory indexes are a format feature, so once enabled they stay on
+    if(opts->dirindex && lxfsSetFeatures(mp, LXFS_FEATURE_DIR_INDEX))
+        luxLogf(KPRINT_LEVEL_WARNING, "failed to enable directory indexes on %s\n", cmd->source);
+
+    // and so is storing small files inline, which older drivers can't read
+    if(opts->inlinedata && lxfsSetFeatures(mp, LXFS_FEATURE_INLINE_DATA))
+        luxLogf(KPRINT_LEVEL_WARNING, "failed to enable inline files on %s\n", cmd->source);
+}
+
+/* lxfsSetFeatures(): marks optional features as in use on a volume
+ * params: mp - mountpoint
+ * params: features - LXFS_FEATURE_* flags to set
+ * returns: zero on success
+ */
+
+int lxfsSetFeatures(Mountpoint *mp, uint8_t features) {
+    if((mp->features & features) == features) return 0;
+
+    LXFSIdentification *id = malloc(512);
+    if(!id) return 1;
+
+    lseek(mp->fd, 0, SEEK_SET);
+    if(read(mp->fd, id, 512) != 512) {
+        free(id);
+        return 1;
+    }
+
+    id->features |= features;
+    lseek(mp->fd, 0, SEEK_SET);
+    if(write(mp->fd, id, 512) != 512) {
+        free(id);
+        return 1;
+    }
+
+    free(id);
+    mp->features |= features;
+    return 0;
+}
+
 Mountpoint *findMP(const char *dev) {
     if(!mps) return NULL;
 
@@ -119,13 +242,25 @@ void lxfsMount(MountCommand *cmd) {
         return;
     }
 
-    Mountpoint *mp = allocateMP();
+    // the size of the cache is up to the mount options
+    MountOptions opts;
+    parseOptions(&opts, cmd);
+
+    Mountpoint *mp = allocateMP(fd, id->volumeSize, blockSizeBytes, buffer, opts.cache);
+    if(!mp && (opts.cache != CACHE_SIZE)) {
+        // a cache too large to allocate shouldn't keep the volume from mounting
+        luxLogf(KPRINT_LEVEL_WARNING, "unable to allocate a cache of %d blocks for %s, using %d\n",
+            opts.cache, cmd->source, CACHE_SIZE);
+        mp = allocateMP(fd, id->volumeSize, blockSizeBytes, buffer, CACHE_SIZE);
+    }
+
     if(!mp) {
         cmd->header.header.status = -ENOMEM;
         close(fd);
         free(id);
         free(buffer);
         free(buffer2);
+        free(meta);
         luxSendDependency(cmd);
         return;
     }
@@ -139,12 +274,29 @@ void lxfsMount(MountCommand *cmd) {
     mp->blockSizeBytes = blockSizeBytes;
     mp->volumeSize = id->volumeSize;
     mp->root = id->rootBlock;
+    mp->features = id->features;
     mp->blockTableBuffer = buffer;
     mp->dataBuffer = buffer2;
     mp->meta = meta;
+    applyOptions(mp, &opts, cmd);
 
     luxLogf(KPRINT_LEVEL_DEBUG, "- %d bytes per sector, %d sectors per block\n", mp->sectorSize, mp->blockSize);
     luxLogf(KPRINT_LEVEL_DEBUG, "- root directory at block %d\n", mp->root);
+    luxLogf(KPRINT_LEVEL_DEBUG, "- %d-way block cache with %d sets\n", mp->cacheWays, mp->cacheSets);
+    luxLogf(KPRINT_LEVEL_DEBUG, "- %d of %d blocks free\n", mp->freeBlocks, mp->volumeSize);
+    luxLogf(KPRINT_LEVEL_DEBUG, "- read-ahead window up to %d blocks\n", mp->readahead);
+    if(mp->table) luxLogf(KPRINT_LEVEL_DEBUG, "- %d block table blocks kept in memory\n", mp->tableSize);
+    if(mp->defrag.enabled) luxLogf(KPRINT_LEVEL_DEBUG, "- background defragmentation enabled\n");
+    lxfsReportFragmentation(mp);
+
+    // volumes last written by older drivers have entries without name hashes,
+    // which are added once and the volume marked so this isn't repeated
+    if(!(mp->features & LXFS_FEATURE_NAME_HASH)) {
+        if(lxfsNameHashUpgrade(mp) || lxfsSetFeatures(mp, LXFS_FEATURE_NAME_HASH))
+            luxLogf(KPRINT_LEVEL_WARNING, "%s: failed to add name hashes to directory entries\n", mp->device);
+    }
+
+    free(id);
 
     cmd->header.header.status = 0;
     luxSendDependency(cmd);
@@ -52,6 +52,7 @@ void lxfsOpen(OpenCommand *ocmd) {
 
             entry.block = 0;
             ocmd->header.header.status = lxfsCreate(&entry, mp, ocmd->path, mode, ocmd->uid, ocmd->gid);
+            if(!ocmd->header.header.status) lxfsHandleOpen(mp, ocmd->id, ocmd->path);
             luxSendKernel(ocmd);
             return;
         }
@@ -86,31 +87,34 @@ void lxfsOpen(OpenCommand *ocmd) {
 
         LXFSFileHeader *meta = (LXFSFileHeader *) mp->meta;
         meta->size = 0;
-        if(lxfsWriteBlock(mp, entry.block, mp->meta)) {
+        if(lxfsWriteFileBlock(mp, entry.block, entry.block, mp->meta)) {
             ocmd->header.header.status = -EIO;
             luxSendKernel(ocmd);
             return;
         }
 
-        uint64_t next = entry.block;
-        while(next != LXFS_BLOCK_EOF) {
-            int s;
-            if(next == entry.block) s = lxfsSetNextBlock(mp, next, LXFS_BLOCK_EOF);
-            else s = lxfsSetNextBlock(mp, next, 0);
+        lxfsChainInvalidate(mp, entry.block);
+        lxfsReserveRelease(mp, entry.block);
 
-            if(s) {
-                ocmd->header.header.status = -EIO;
-                luxSendKernel(ocmd);
-                return;
-            }
+        // keep the header block and free the data chain after it
+        uint64_t first = lxfsNextBlock(mp, entry.block);
+        if(!first) {
+            ocmd->header.header.status = -EIO;
+            luxSendKernel(ocmd);
+            return;
+        }
 
-            next = lxfsNextBlock(mp, next);
-            if(!next) {
+        if(first != LXFS_BLOCK_EOF) {
+            if(lxfsSetNextBlock(mp, entry.block, LXFS_BLOCK_EOF) || lxfsFreeChain(mp, first)) {
                 ocmd->header.header.status = -EIO;
                 luxSendKernel(ocmd);
                 return;
             }
         }
+
+        // every other open handle on the file sees it empty now
+        LXFSFileHeader header = { .size = 0, .refCount = meta->refCount };
+        lxfsHandleUpdate(mp, entry.block, &header, LXFS_BLOCK_EOF, 0);
     }
 
     // recursively redirect for soft links
@@ -148,5 +152,6 @@ void lxfsOpen(OpenCommand *ocmd) {
         if((ocmd->flags & O_WRONLY) && !(entry.permissions & LXFS_PERMS_OTHER_W)) ocmd->header.header.status = -EACCES;
     }
 
+    if(!ocmd->header.header.status) lxfsHandleOpen(mp, ocmd->id, ocmd->path);
     luxSendKernel(ocmd);
 }
\ No newline at end of file
@@ -31,34 +31,59 @@ void lxfsRead(RWCommand *rcmd) {
         return;
     }
 
-    // and the file entry
-    LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, rcmd->path, NULL, NULL)) {
-        rcmd->header.header.status = -ENOENT;
-        luxSendKernel(rcmd);
-        return;
-    }
+    // and the file, straight from its handle if it is open
+    uint64_t file, size, first;
+    Handle *handle = lxfsHandleGet(mp, rcmd->id, rcmd->path);
+    if(handle) {
+        file = handle->file;
+        size = handle->header.size;
+        first = handle->first;
+    } else {
+        // appends absorbed through handles haven't updated the header yet
+        if(lxfsAppendCommitAll(mp, 0)) {
+            rcmd->header.header.status = -EIO;
+            luxSendKernel(rcmd);
+            return;
+        }
 
-    // use the file entry to read metadata as well as find the first file block
-    uint64_t first = lxfsReadNextBlock(mp, entry.block, mp->meta);
-    if(!first) {
-        rcmd->header.header.status = -EIO;
-        luxSendKernel(rcmd);
-        return;
-    }
+        LXFSDirectoryEntry entry;
+        if(!lxfsFind(&entry, mp, rcmd->path, NULL, NULL)) {
+            rcmd->header.header.status = -ENOENT;
+            luxSendKernel(rcmd);
+            return;
+        }
+
+        // use the file entry to read metadata as well as find the first file
+        // block, reading the header in place in the cache
+        Cache *header = lxfsBorrowBlock(mp, entry.block);
+        if(!header) {
+            rcmd->header.header.status = -EIO;
+            luxSendKernel(rcmd);
+            return;
+        }
 
-    LXFSFileHeader *metadata = (LXFSFileHeader *) mp->meta;
+        file = entry.block;
+        size = ((LXFSFileHeader *) header->data)->size;
+        lxfsReturnBlock(header);
+
+        first = lxfsNextBlock(mp, entry.block);
+        if(!first) {
+            rcmd->header.header.status = -EIO;
+            luxSendKernel(rcmd);
+            return;
+        }
+    }
 
     // input validation
-    if(rcmd->position >= metadata->size) {
+    if(rcmd->position >= size) {
         rcmd->header.header.status = -EOVERFLOW;
         luxSendKernel(rcmd);
         return;
     }
 
     size_t truelen;
-    if((rcmd->position + rcmd->length) > metadata->size)
-        truelen = metadata->size - rcmd->position;
+    if((rcmd->position + rcmd->length) > size)
+        truelen = size - rcmd->position;
     else
         truelen = rcmd->length;
     
@@ -72,22 +97,39 @@ void lxfsRead(RWCommand *rcmd) {
     // copy the header
     memcpy(res, rcmd, sizeof(RWCommand));
 
-    // now calculate which block to start from and offset into the firsty block
-    uint64_t startBlock = rcmd->position / mp->blockSizeBytes;
-    uint64_t startOffset = rcmd->position % mp->blockSizeBytes;
-    uint64_t block = first;
-
-    // find the starting block
-    while(startBlock) {
-        block = lxfsNextBlock(mp, block);
-        if(!block) {
+    // small files are read straight from the block holding their header
+    if(LXFS_INLINE(first, size)) {
+        if(lxfsInlineRead(mp, file, rcmd->position, truelen, res->data)) {
             free(res);
             rcmd->header.header.status = -EIO;
             luxSendKernel(rcmd);
             return;
         }
 
-        startBlock--;
+        res->position += truelen;
+        res->length = truelen;
+        res->header.header.status = truelen;
+        res->header.header.length += truelen;
+        luxSendKernel(res);
+        free(res);
+        return;
+    }
+
+    // now calculate which block to start from and offset into the firsty block
+    uint64_t startBlock = rcmd->position / mp->blockSizeBytes;
+    uint64_t startOffset = rcmd->position % mp->blockSizeBytes;
+    uint64_t block;
+
+    // find the starting block using the chain index of the open file
+    ChainIndex *index = lxfsChainIndex(mp, rcmd->id, file, first);
+    if(index) block = lxfsChainLookup(mp, index, startBlock);
+    else block = lxfsGetBlock(mp, first, rcmd->position);
+
+    if(!block) {
+        free(res);
+        rcmd->header.header.status = -EIO;
+        luxSendKernel(rcmd);
+        return;
     }
 
     // and begin - we will use separate counters for this, because even though
@@ -96,31 +138,48 @@ void lxfsRead(RWCommand *rcmd) {
     // corruption, missing blocks, etc
     size_t readCount = 0;
     size_t remaining = truelen;
-    while(readCount < truelen) {
-        size_t s;
 
-        // here and ONLY here we're allowed to break out of the loop without
-        // throwing errors, provided we've read at least some of the file
-        if(block == LXFS_BLOCK_EOF) break;
-        block = lxfsReadNextBlock(mp, block, mp->dataBuffer);
-        if(!block) break;
+    // the starting block may be partially read, which is copied straight from
+    // the cache into the response - the response is zeroed already, so holes
+    // in sparse files need no copy at all
+    if(startOffset || (remaining < mp->blockSizeBytes)) {
+        int unwritten = lxfsIsUnwritten(mp, block);
+        Cache *slot = unwritten ? NULL : lxfsBorrowBlock(mp, block);
+        if(unwritten || slot) {
+            if(remaining >= (mp->blockSizeBytes - startOffset)) readCount = mp->blockSizeBytes - startOffset;
+            else readCount = remaining;
+
+            if(slot) {
+                memcpy(res->data, slot->data+startOffset, readCount);
+                lxfsReturnBlock(slot);
+            }
 
-        if(!readCount) {
-            // special case for starting block
-            if(remaining >= (mp->blockSizeBytes - startOffset)) s = mp->blockSizeBytes - startOffset;
-            else s = remaining;
+            remaining -= readCount;
 
-            memcpy((void *)((uintptr_t)res->data + readCount), mp->dataBuffer+startOffset, s);
+            block = lxfsNextBlock(mp, block);
         } else {
-            // for all other blocks
-            if(remaining > mp->blockSizeBytes) s = mp->blockSizeBytes;
-            else s = remaining;
+            block = 0;
+        }
+    }
 
-            memcpy((void *)((uintptr_t)res->data + readCount), mp->dataBuffer, s);
+    // whole blocks are read straight into the response, with physically
+    // contiguous runs of the chain coalesced into single device reads
+    if(block && (remaining >= mp->blockSizeBytes)) {
+        size_t s = lxfsReadChain(mp, &block, remaining / mp->blockSizeBytes, (void *)((uintptr_t)res->data + readCount));
+        readCount += s * mp->blockSizeBytes;
+        remaining -= s * mp->blockSizeBytes;
+    }
+
+    // and the last block may also be partially read
+    if(remaining && block && (block != LXFS_BLOCK_EOF)) {
+        int unwritten = lxfsIsUnwritten(mp, block);
+        Cache *slot = unwritten ? NULL : lxfsBorrowBlock(mp, block);
+        if(slot) {
+            memcpy((void *)((uintptr_t)res->data + readCount), slot->data, remaining);
+            lxfsReturnBlock(slot);
         }
 
-        readCount += s;
-        remaining -= s;
+        if(unwritten || slot) readCount += remaining;
     }
 
     // appropriately update the file descriptor position and status flags
@@ -135,4 +194,7 @@ void lxfsRead(RWCommand *rcmd) {
 
     luxSendKernel(res);
     free(res);
+
+    // the response is already on its way, so read ahead for the next request
+    if(index && readCount) lxfsReadahead(mp, index, startBlock, (rcmd->position + readCount - 1) / mp->blockSizeBytes);
 }
\ No newline at end of file
@@ -29,14 +29,13 @@ void lxfsStatvfs(StatvfsCommand *cmd) {
     cmd->buffer.f_flag = ST_NOSUID;
     cmd->buffer.f_namemax = 511;
 
+    // both counters are maintained as the block table changes, so this
+    // doesn't need to touch the disk, and blocks reserved for files being
+    // appended to are still free
+    cmd->buffer.f_bfree = mp->freeBlocks + mp->reservedBlocks;
     cmd->buffer.f_files = cmd->buffer.f_blocks / 2;
-    cmd->buffer.f_ffree = cmd->buffer.f_files;
-
-    for(uint64_t i = 0; i < mp->volumeSize; i++) {
-        uint64_t block = lxfsNextBlock(mp, i);
-        if(!block) cmd->buffer.f_bfree++;
-        else if(block == LXFS_BLOCK_EOF) cmd->buffer.f_ffree--;
-    }
+    if(mp->fileCount < cmd->buffer.f_files)
+        cmd->buffer.f_ffree = cmd->buffer.f_files - mp->fileCount;
 
     cmd->buffer.f_bavail = cmd->buffer.f_bfree;
     cmd->buffer.f_favail = cmd->buffer.f_ffree;
@@ -0,0 +1,144 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* With the tablemirror mount option, the whole block table is loaded into a
+ * contiguous array at mount time, and chain lookups and updates go to the
+ * array instead of through the block cache, where table blocks would compete
+ * with data for slots. Updated table blocks are tracked in a bitmap with one
+ * bit per table block, and runs of adjacent dirty table blocks are written
+ * back in a single device write straight from the array, at the same points
+ * the cache writes back shared metadata. Volumes whose table is larger than
+ * TABLE_MIRROR_MAX, or that can't be mirrored for lack of memory, fall back
+ * to going through the cache.
+ */
+
+/* lxfsTableInit(): loads the block table into memory
+ * params: mp - mountpoint
+ * this must be called before any table block is read through the cache
+ * returns: zero on success
+ */
+
+int lxfsTableInit(Mountpoint *mp) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t tableSize = (mp->volumeSize + entries - 1) / entries;
+    if((tableSize * mp->blockSizeBytes) > TABLE_MIRROR_MAX) return 1;
+
+    uint64_t *table = malloc(tableSize * mp->blockSizeBytes);
+    uint64_t *dirty = calloc((tableSize + 63) / 64, sizeof(uint64_t));
+    if(!table || !dirty) {
+        free(table);
+        free(dirty);
+        return 1;
+    }
+
+    for(uint64_t i = 0; i < tableSize; i += FLUSH_BATCH) {
+        uint64_t count = tableSize - i;
+        if(count > FLUSH_BATCH) count = FLUSH_BATCH;
+
+        ssize_t size = count * mp->blockSizeBytes;
+        lseek(mp->fd, (i + 33) * mp->blockSizeBytes, SEEK_SET);
+        if(read(mp->fd, (void *) table + (i * mp->blockSizeBytes), size) != size) {
+            free(table);
+            free(dirty);
+            return 1;
+        }
+    }
+
+    mp->table = table;
+    mp->tableSize = tableSize;
+    mp->tableDirty = dirty;
+    mp->tableDirtyCount = 0;
+    return 0;
+}
+
+/* lxfsTableMarkDirty(): marks a block of the mirrored table for writeback
+ * params: mp - mountpoint
+ * params: tableBlock - block table block, counting from the start of the table
+ * returns: nothing
+ */
+
+void lxfsTableMarkDirty(Mountpoint *mp, uint64_t tableBlock) {
+    uint64_t bit = 1ULL << (tableBlock % 64);
+    if(mp->tableDirty[tableBlock / 64] & bit) return;
+
+    mp->tableDirty[tableBlock / 64] |= bit;
+    if(!mp->dirtyCount && !mp->tableDirtyCount) mp->dirtySince = time(NULL);
+    mp->tableDirtyCount++;
+}
+
+/* lxfsTableFlushBlock(): writes back a single block of the mirrored table
+ * params: mp - mountpoint
+ * params: tableBlock - block table block, counting from the start of the table
+ * returns: zero on success
+ */
+
+int lxfsTableFlushBlock(Mountpoint *mp, uint64_t tableBlock) {
+    uint64_t bit = 1ULL << (tableBlock % 64);
+    if(!mp->table || (tableBlock >= mp->tableSize) || !(mp->tableDirty[tableBlock / 64] & bit)) return 0;
+
+    lseek(mp->fd, (tableBlock + 33) * mp->blockSizeBytes, SEEK_SET);
+    if(write(mp->fd, (void *) mp->table + (tableBlock * mp->blockSizeBytes), mp->blockSizeBytes) != mp->blockSizeBytes)
+        return 1;
+
+    mp->tableDirty[tableBlock / 64] &= ~bit;
+    mp->tableDirtyCount--;
+    mp->flushedBlocks++;
+    mp->flushWrites++;
+    return 0;
+}
+
+/* lxfsTableFlush(): writes back the dirty blocks of the mirrored table
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsTableFlush(Mountpoint *mp) {
+    if(!mp->table || !mp->tableDirtyCount) return 0;
+
+    int status = 0;
+    uint64_t i = 0;
+    while(i < mp->tableSize) {
+        // skip clean table blocks a whole word at a time
+        if(!mp->tableDirty[i / 64]) {
+            i = ((i / 64) + 1) * 64;
+            continue;
+        }
+
+        if(!(mp->tableDirty[i / 64] & (1ULL << (i % 64)))) {
+            i++;
+            continue;
+        }
+
+        // the mirror is contiguous, so a run of dirty blocks is written as is
+        uint64_t length = 1;
+        while(((i + length) < mp->tableSize)
+        && (mp->tableDirty[(i + length) / 64] & (1ULL << ((i + length) % 64))))
+            length++;
+
+        ssize_t size = length * mp->blockSizeBytes;
+        lseek(mp->fd, (i + 33) * mp->blockSizeBytes, SEEK_SET);
+        if(write(mp->fd, (void *) mp->table + (i * mp->blockSizeBytes), size) == size) {
+            for(uint64_t j = i; j < (i + length); j++)
+                mp->tableDirty[j / 64] &= ~(1ULL << (j % 64));
+
+            mp->tableDirtyCount -= length;
+            mp->flushedBlocks += length;
+            mp->flushWrites++;
+        } else {
+            status = 1;     // leave them dirty and carry on with the rest
+        }
+
+        i += length;
+    }
+
+    return status;
+}
@@ -9,137 +9,392 @@
 #include <lxfs/lxfs.h>
 #include <vfs.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 
+/* lxfsWriteChainData(): writes data to the start of a newly allocated chain
+ * params: mp - mountpoint
+ * params: file - header block of the file
+ * params: block - first block of the chain
+ * params: data - data to write
+ * params: size - number of bytes to write, fitting in the chain
+ * params: tail - pointer to store the last block written
+ * returns: zero on success
+ */
+
+static int lxfsWriteChainData(Mountpoint *mp, uint64_t file, uint64_t block,
+                              const void *data, uint64_t size, uint64_t *tail) {
+    // whole blocks are written straight from the request, and only a partial
+    // last block is copied through the data buffer
+    uint64_t count = size / mp->blockSizeBytes;
+    if(lxfsWriteChain(mp, file, &block, count, data, tail) != count) return 1;
+
+    size -= count * mp->blockSizeBytes;
+    if(!size) return 0;
+
+    memcpy(mp->dataBuffer, data + (count * mp->blockSizeBytes), size);
+    *tail = block;
+    return !lxfsWriteNextFileBlock(mp, file, block, mp->dataBuffer);
+}
+
 /* lxfsWriteNew(): helper function to write to a new file
  * params: wcmd - write command message
  * params: mp - mountpoint
  * params: entry - directory entry for the file
  * params: metadata - file metadata block
- * returns: nothing, response relayed to kernel
+ * returns: number of bytes written, negative errno error code on fail
  */
 
-void lxfsWriteNew(RWCommand *wcmd, Mountpoint *mp, LXFSDirectoryEntry *entry, LXFSFileHeader *metadata) {
+static int lxfsWriteNew(RWCommand *wcmd, Mountpoint *mp, LXFSDirectoryEntry *entry, LXFSFileHeader *metadata) {
     // round up to block size
     uint64_t blockCount = (wcmd->length+mp->blockSizeBytes-1) / mp->blockSizeBytes;
-    uint64_t block = lxfsAllocate(mp, blockCount);
+    uint64_t block = lxfsAllocate(mp, blockCount, entry->block, entry->block);
     uint64_t first = block;
     if(!block) {
-        wcmd->header.header.status = -ENOSPC;   /* out of space */
-        luxSendKernel(wcmd);
-        return;
+        return -ENOSPC;   /* out of space */
     }
 
-    uint64_t size = wcmd->length;
-    uint64_t position = 0;
-    while(size) {
-        if(size > mp->blockSizeBytes) {
-            memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), mp->blockSizeBytes);
-            size -= mp->blockSizeBytes;
-            position += mp->blockSizeBytes;
-        } else {
-            memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), size);
-            size = 0;
-        }
-
-        block = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
-        if(!block) {
-            wcmd->header.header.status = -EIO;
-            luxSendKernel(wcmd);
-            return;
-        }
+    uint64_t tail = block;
+    if(lxfsWriteChainData(mp, entry->block, block, wcmd->data, wcmd->length, &tail)) {
+        return -EIO;
     }
 
     // update file metadata
     metadata->size = wcmd->length;
-    if(lxfsWriteBlock(mp, entry->block, mp->meta)) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
+    if(lxfsWritePartial(mp, entry->block, entry->block, 0, metadata, sizeof(LXFSFileHeader))) {
+        return -EIO;
     }
 
     if(lxfsSetNextBlock(mp, entry->block, first)) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
+        return -EIO;
     }
 
-    wcmd->header.header.status = wcmd->length;
+    lxfsHandleUpdate(mp, entry->block, metadata, first, tail);
+
     wcmd->position += wcmd->length;
-    luxSendKernel(wcmd);
+    return wcmd->length;
 }
 
-/* lxfsWrite(): writes to an opened file on an lxfs volume
+/* lxfsWriteTimestamps(): updates the access and modification times of a
+ * directory entry in place
+ * params: mp - mountpoint
+ * params: block - block containing the directory entry
+ * params: offset - offset of the entry within the block
+ * params: timestamp - new access and modification time
+ * returns: zero on success
+ */
+
+int lxfsWriteTimestamps(Mountpoint *mp, uint64_t block, off_t offset, uint64_t timestamp) {
+    // the two are adjacent in the entry
+    uint64_t times[2] = { timestamp, timestamp };
+    return lxfsWritePartial(mp, 0, block, offset + offsetof(LXFSDirectoryEntry, modTime), times, sizeof(times));
+}
+
+/* lxfsWriteFinish(): updates the timestamps of a file after a write and
+ * completes the request
  * params: wcmd - write command message
- * returns: nothing, response relayed to kernel
+ * params: mp - mountpoint
+ * params: dirBlock - block containing the directory entry of the file
+ * params: dirOffset - offset of the entry within the block
+ * returns: number of bytes written, negative errno error code on fail
  */
 
-void lxfsWrite(RWCommand *wcmd) {
-    wcmd->header.header.response = 1;
-    wcmd->header.header.length = sizeof(RWCommand);
+static int lxfsWriteFinish(RWCommand *wcmd, Mountpoint *mp, uint64_t dirBlock, off_t dirOffset) {
+    time_t timestamp = time(NULL);
+    if(lxfsWriteTimestamps(mp, dirBlock, dirOffset, timestamp)) {
+        return -EIO;
+    }
+
+    lxfsDentryTouch(mp, wcmd->path, timestamp, timestamp);
+
+    wcmd->position += wcmd->length;
+    return wcmd->length;
+}
+
+/* lxfsZeroChain(): makes a newly allocated chain read as zeroes; all but its
+ * last block are flagged as unwritten, or written out as zeroes on volumes
+ * that can't be marked as having unwritten blocks, and the last block, which
+ * is usually about to be written, is only zeroed in the cache
+ * params: mp - mountpoint
+ * params: file - header block of the file the chain belongs to
+ * params: block - first block of the chain
+ * params: count - number of blocks in the chain
+ * params: last - pointer to store the last block of the chain
+ * returns: zero on success, negative errno error code on fail
+ */
+
+int lxfsZeroChain(Mountpoint *mp, uint64_t file, uint64_t block, uint64_t count, uint64_t *last) {
+    // older drivers would follow a flagged link as a block number, so the
+    // volume is marked the first time one is written
+    int flag = (count > 1) && !lxfsSetFeatures(mp, LXFS_FEATURE_UNWRITTEN);
+
+    TableEdit *edits = NULL;
+    void *zeroes = NULL;
+    if(count > 1) {
+        if(flag) edits = malloc((count - 1) * sizeof(TableEdit));
+        else zeroes = calloc(COPY_BLOCKS, mp->blockSizeBytes);
+        if(!edits && !zeroes) return -ENOMEM;
+    }
+
+    uint64_t newBlock = block, run = block, length = 0;
+    for(uint64_t i = 0; i < count-1; i++) {
+        uint64_t next = lxfsNextBlock(mp, newBlock);
+        if(!next || (next == LXFS_BLOCK_EOF)) {
+            free(edits);
+            free(zeroes);
+            return -EIO;
+        }
+
+        if(flag) {
+            edits[i].block = newBlock;
+            edits[i].next = next | LXFS_BLOCK_UNWRITTEN;
+        } else if((++length == COPY_BLOCKS) || (next != (newBlock + 1))) {
+            // zeroes are written a physically contiguous run at a time
+            if(lxfsStreamBlocks(mp, run, length, zeroes)) {
+                free(zeroes);
+                return -EIO;
+            }
+
+            run = next;
+            length = 0;
+        }
+
+        newBlock = next;
+    }
+
+    int status = 0;
+    if(edits && lxfsSetNextBlocks(mp, edits, count-1)) status = -EIO;
+    if(length && lxfsStreamBlocks(mp, run, length, zeroes)) status = -EIO;
+    free(edits);
+    free(zeroes);
+    if(status) return status;
+
+    memset(mp->dataBuffer, 0, mp->blockSizeBytes);
+    if(lxfsWriteFileBlock(mp, file, newBlock, mp->dataBuffer)) return -EIO;
+
+    *last = newBlock;
+    return 0;
+}
+
+/* lxfsWriteExtend(): extends a file up to a write starting past its end,
+ * leaving a hole that reads as zeroes; the blocks in the hole are allocated
+ * but flagged as unwritten where the volume allows it, so extending a file
+ * costs metadata only
+ * params: wcmd - write command message
+ * params: mp - mountpoint
+ * params: entry - directory entry for the file
+ * params: first - first data block of the file, updated if the file was empty
+ * params: metadata - file metadata block, its size is updated
+ * returns: zero on success, negative errno error code on fail
+ */
+
+static int lxfsWriteExtend(RWCommand *wcmd, Mountpoint *mp, LXFSDirectoryEntry *entry,
+                           uint64_t *first, LXFSFileHeader *metadata) {
+    uint64_t blocks = (metadata->size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    uint64_t target = wcmd->position / mp->blockSizeBytes;
+
+    // find the last block of the file, which is the header for empty files
+    uint64_t last = entry->block;
+    if(blocks) {
+        ChainIndex *index = lxfsChainIndex(mp, wcmd->id, entry->block, *first);
+        if(index) last = lxfsChainLookup(mp, index, blocks-1);
+        else last = lxfsGetBlock(mp, *first, metadata->size-1);
+        if(!last || (last == LXFS_BLOCK_EOF)) return -EIO;
+    }
+
+    // whatever follows the end of the file in its last block must read as
+    // zeroes now that it becomes part of the file
+    uint64_t tail = metadata->size % mp->blockSizeBytes;
+    if(tail) {
+        if(lxfsReadBlock(mp, last, mp->dataBuffer)) return -EIO;
+        memset(mp->dataBuffer + tail, 0, mp->blockSizeBytes - tail);
+        if(lxfsWriteFileBlock(mp, entry->block, last, mp->dataBuffer)) return -EIO;
+    }
+
+    // space preallocated past the end of the file already reads as zeroes
+    uint64_t next = lxfsNextBlock(mp, last);
+    while((next != LXFS_BLOCK_EOF) && (blocks <= target)) {
+        if(!next) return -EIO;
+        last = next;
+        blocks++;
+        next = lxfsNextBlock(mp, last);
+    }
+
+    if(target < blocks) {
+        // the write starts within the last block, or one preallocated
+        metadata->size = wcmd->position;
+        return 0;
+    }
+
+    // allocate every block up to and including the one the write starts in
+    uint64_t count = target - blocks + 1;
+    uint64_t block = lxfsAllocate(mp, count, last, entry->block);
+    if(!block) return -ENOSPC;
+
+    uint64_t newBlock;
+    int status = lxfsZeroChain(mp, entry->block, block, count, &newBlock);
+    if(status || lxfsSetNextBlock(mp, last, block)) {
+        lxfsFreeChain(mp, block);
+        return status ? status : -EIO;
+    }
+
+    if(*first == LXFS_BLOCK_EOF) *first = block;
+    metadata->size = wcmd->position;
+    return 0;
+}
 
+/* lxfsWriteData(): writes to a file on an lxfs volume without responding
+ * params: wcmd - write command message, its position is updated
+ * returns: number of bytes written, negative errno error code on fail
+ */
+
+int lxfsWriteData(RWCommand *wcmd) {
     Mountpoint *mp = findMP(wcmd->device);
     if(!mp) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
+        return -EIO;
     }
 
+    // the handle of the open file saves looking it up again
     LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, wcmd->path, NULL, NULL)) {
-        wcmd->header.header.status = -ENOENT;
-        luxSendKernel(wcmd);
-        return;
-    }
+    LXFSFileHeader header;
+    uint64_t first, dirBlock;
+    off_t dirOffset;
+
+    Handle *handle = lxfsHandleGet(mp, wcmd->id, wcmd->path);
+    if(handle) {
+        entry.block = handle->file;
+        dirBlock = handle->dirBlock;
+        dirOffset = handle->dirOffset;
+        memcpy(&header, &handle->header, sizeof(LXFSFileHeader));
+        first = handle->first;
+    } else {
+        // appends absorbed through handles haven't updated the header yet
+        if(lxfsAppendCommitAll(mp, 0)) {
+            return -EIO;
+        }
+
+        if(!lxfsFind(&entry, mp, wcmd->path, &dirBlock, &dirOffset)) {
+            return -ENOENT;
+        }
 
-    uint64_t first = lxfsReadNextBlock(mp, entry.block, mp->meta);
-    if(!first) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
+        Cache *slot = lxfsBorrowBlock(mp, entry.block);
+        if(!slot) {
+            return -EIO;
+        }
+
+        memcpy(&header, slot->data, sizeof(LXFSFileHeader));
+        lxfsReturnBlock(slot);
+
+        first = lxfsNextBlock(mp, entry.block);
+        if(!first) {
+            return -EIO;
+        }
     }
 
-    LXFSFileHeader *metadata = (LXFSFileHeader *) mp->meta;
+    LXFSFileHeader *metadata = &header;
 
     // the kernel will communicate O_APPEND by setting position to -1
     if(wcmd->position == -1)
         wcmd->position = metadata->size;
 
-    /* TODO: handle case for padding with zeroes when position > actual size */
+    // small appends are absorbed into the last block of the file, and any
+    // other write first brings the file up to date with them
+    if(handle) {
+        if(!lxfsAppendAbsorb(mp, handle, wcmd->position, wcmd->data, wcmd->length)) {
+            wcmd->position += wcmd->length;
+            return wcmd->length;
+        }
+
+        if(lxfsAppendCommit(mp, entry.block)) {
+            return -EIO;
+        }
+    }
+
+    // writing nothing leaves the file as it is, wherever the write starts
+    if(!wcmd->length) {
+        return 0;
+    }
+
+    // small files are kept in the block holding their header for as long as
+    // they fit, and moved to a data chain of their own once they don't
+    if((first == LXFS_BLOCK_EOF) && (mp->features & LXFS_FEATURE_INLINE_DATA)
+    && ((wcmd->position + wcmd->length) <= LXFS_INLINE_MAX(mp))) {
+        if(lxfsInlineWrite(mp, entry.block, metadata, wcmd->position, wcmd->data, wcmd->length)) {
+            return -EIO;
+        }
+
+        lxfsHandleUpdate(mp, entry.block, metadata, first, 0);
+        return lxfsWriteFinish(wcmd, mp, dirBlock, dirOffset);
+    } else if(LXFS_INLINE(first, metadata->size)) {
+        int status = lxfsInlineConvert(mp, entry.block, metadata, &first);
+        if(status) {
+            return status;
+        }
+    }
+
+    // writing past the end of the file leaves a hole
     if(wcmd->position > metadata->size) {
-        luxLogf(KPRINT_LEVEL_ERROR, "TODO: position > file size, handle zero pad case\n");
-        wcmd->header.header.status = -ENOSYS;   /* not implemented */
-        luxSendKernel(wcmd);
-        return;
+        int status = lxfsWriteExtend(wcmd, mp, &entry, &first, metadata);
+        if(status) {
+            return status;
+        }
     }
 
     // check if this is a new file
     if(first == LXFS_BLOCK_EOF) {
-        lxfsWriteNew(wcmd, mp, &entry, metadata);
-        return;
+        return lxfsWriteNew(wcmd, mp, &entry, metadata);
     }
 
     // here we're writing to an existing file
-    uint64_t block = lxfsGetBlock(mp, first, wcmd->position);
-    uint64_t prevBlock;
-    if(wcmd->position >= mp->blockSizeBytes)
-        prevBlock = lxfsGetBlock(mp, first, wcmd->position-mp->blockSizeBytes);
-    else
-        prevBlock = block;
+    uint64_t block, prevBlock;
+    uint64_t logical = wcmd->position / mp->blockSizeBytes;
+    uint64_t blocks = (metadata->size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    ChainIndex *index = lxfsChainIndex(mp, wcmd->id, entry.block, first);
+    if(handle && handle->tail && ((logical + 1) >= blocks)
+    && (lxfsNextBlock(mp, handle->tail) == LXFS_BLOCK_EOF)) {
+        // appends go straight to the last block of the file
+        prevBlock = handle->tail;
+        block = (logical < blocks) ? handle->tail : 0;
+    } else if(index) {
+        block = lxfsChainLookup(mp, index, logical);
+        if(logical) prevBlock = lxfsChainLookup(mp, index, logical-1);
+        else prevBlock = block;
+    } else {
+        block = lxfsGetBlock(mp, first, wcmd->position);
+        if(wcmd->position >= mp->blockSizeBytes)
+            prevBlock = lxfsGetBlock(mp, first, wcmd->position-mp->blockSizeBytes);
+        else
+            prevBlock = block;
+    }
 
     uint64_t size = wcmd->length;
     uint64_t position = 0;
     uint64_t tempPosition = wcmd->position % mp->blockSizeBytes;
 
     while(size && block && (block != LXFS_BLOCK_EOF)) {
-        if(lxfsReadBlock(mp, block, mp->dataBuffer)) {
-            wcmd->header.header.status = -EIO;
-            luxSendKernel(wcmd);
-            return;
+        // whole blocks go straight from the request, without reading them
+        if(!tempPosition && (size >= mp->blockSizeBytes)) {
+            uint64_t count = lxfsWriteChain(mp, entry.block, &block, size / mp->blockSizeBytes,
+                                            wcmd->data + position, &prevBlock);
+            if(!block) {
+                return -EIO;
+            }
+
+            size -= count * mp->blockSizeBytes;
+            position += count * mp->blockSizeBytes;
+            continue;
+        }
+
+        // blocks in a hole have never been written and start out as zeroes
+        int unwritten = lxfsIsUnwritten(mp, block);
+        if(unwritten) {
+            memset(mp->dataBuffer, 0, mp->blockSizeBytes);
+        } else if(lxfsReadBlock(mp, block, mp->dataBuffer)) {
+            return -EIO;
         }
 
         if(size >= (mp->blockSizeBytes - tempPosition)) {
@@ -153,89 +408,62 @@ void lxfsWrite(RWCommand *wcmd) {
         }
 
         prevBlock = block;
-        block = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
+        block = lxfsWriteNextFileBlock(mp, entry.block, block, mp->dataBuffer);
         if(!block) {
-            wcmd->header.header.status = -EIO;
-            luxSendKernel(wcmd);
-            return;
+            return -EIO;
+        }
+
+        // and clear the flag now that it holds data
+        if(unwritten && lxfsSetNextBlock(mp, prevBlock, block)) {
+            return -EIO;
         }
     }
 
+    // the write ends in the last block of the file if it ran into the end of
+    // the chain, otherwise the last block stays as it was
+    uint64_t tail = handle ? handle->tail : 0;
+    if(block == LXFS_BLOCK_EOF) tail = prevBlock;
+
     if(size) {
         // allocate new blocks for the remaining bytes
         uint64_t blockCount = (size+mp->blockSizeBytes-1) / mp->blockSizeBytes;
-        uint64_t newBlock = lxfsAllocate(mp, blockCount);
+        uint64_t newBlock = lxfsAllocate(mp, blockCount, prevBlock, entry.block);
         uint64_t firstNewBlock = newBlock;
+        tail = newBlock;
         if(!newBlock) {
-            wcmd->header.header.status = -ENOSPC;   /* out of storage */
-            luxSendKernel(wcmd);
-            return;
-        }
-
-        while(size) {
-            if(size > mp->blockSizeBytes) {
-                memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), mp->blockSizeBytes);
-                size -= mp->blockSizeBytes;
-                position += mp->blockSizeBytes;
-            } else {
-                memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), size);
-                size = 0;
-            }
+            return -ENOSPC;   /* out of storage */
+        }
 
-            newBlock = lxfsWriteNextBlock(mp, newBlock, mp->dataBuffer);
-            if(!newBlock) {
-                wcmd->header.header.status = -EIO;
-                luxSendKernel(wcmd);
-                return;
-            }
+        if(lxfsWriteChainData(mp, entry.block, newBlock, wcmd->data + position, size, &tail)) {
+            return -EIO;
         }
 
         // update the block list
         if(lxfsSetNextBlock(mp, prevBlock, firstNewBlock)) {
-            wcmd->header.header.status = -EIO;
-            luxSendKernel(wcmd);
-            return;
+            return -EIO;
         }
     }
 
-    // and finally update the file metadata header
-    metadata->size += wcmd->length;
-    if(lxfsWriteBlock(mp, entry.block, mp->meta)) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
+    // and finally update the file metadata header, overwrites within the
+    // file don't change its size
+    if((wcmd->position + wcmd->length) > metadata->size)
+        metadata->size = wcmd->position + wcmd->length;
+    if(lxfsWritePartial(mp, entry.block, entry.block, 0, metadata, sizeof(LXFSFileHeader))) {
+        return -EIO;
     }
 
-    // and update the timestamps
-    time_t timestamp = time(NULL);
-    uint64_t dirBlock;
-    off_t dirOffset;
-    if(!lxfsFind(&entry, mp, wcmd->path, &dirBlock, &dirOffset)) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
-    }
-
-    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + dirOffset);
-    dir->accessTime = timestamp;
-    dir->modTime = timestamp;
-
-    uint64_t next = lxfsWriteNextBlock(mp, dirBlock, mp->dataBuffer);
-    if(!next) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
-    }
+    lxfsHandleUpdate(mp, entry.block, metadata, first, tail);
+    return lxfsWriteFinish(wcmd, mp, dirBlock, dirOffset);
+}
 
-    if((dirOffset + entry.entrySize) > mp->blockSizeBytes) {
-        if(lxfsWriteBlock(mp, next, (const void *)((uintptr_t)mp->dataBuffer + mp->blockSizeBytes))) {
-            wcmd->header.header.status = -EIO;
-            luxSendKernel(wcmd);
-            return;
-        }
-    }
+/* lxfsWrite(): writes to an opened file on an lxfs volume
+ * params: wcmd - write command message
+ * returns: nothing, response relayed to kernel
+ */
 
-    wcmd->header.header.status = wcmd->length;
-    wcmd->position += wcmd->length;
+void lxfsWrite(RWCommand *wcmd) {
+    wcmd->header.header.response = 1;
+    wcmd->header.header.length = sizeof(RWCommand);
+    wcmd->header.header.status = lxfsWriteData(wcmd);
     luxSendKernel(wcmd);
 }
\ No newline at end of file
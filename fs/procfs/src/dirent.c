@@ -0,0 +1,100 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * procfs: Microkernel server implementing the /proc file system
+ */
+
+#include <procfs/procfs.h>
+#include <liblux/liblux.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/* files in the root of /proc, in the order they are listed */
+static const char *rootFiles[] = {
+    "cpu", "kernel", "memsize", "memusage", "pagesize", "uptime",
+};
+
+#define ROOT_FILES      (sizeof(rootFiles) / sizeof(rootFiles[0]))
+
+/* procfsGetdents(): reads as many directory entries as fit in one message
+ * params: gcmd - getdents command message
+ * returns: nothing, response relayed to vfs
+ */
+
+void procfsGetdents(GetdentsCommand *gcmd) {
+    gcmd->header.header.response = 1;
+    gcmd->header.header.length = sizeof(GetdentsCommand);
+
+    pid_t pid;
+    if(strcmp(gcmd->path, "/")) {
+        if(resolve(gcmd->path, &pid) < 0) gcmd->header.header.status = -ENOENT;
+        else gcmd->header.header.status = -ENOTDIR;
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    // the response can't be larger than a message
+    size_t capacity = gcmd->length;
+    if(capacity > (SERVER_MAX_SIZE - sizeof(GetdentsCommand)))
+        capacity = SERVER_MAX_SIZE - sizeof(GetdentsCommand);
+
+    GetdentsCommand *res = calloc(1, sizeof(GetdentsCommand) + capacity);
+    if(!res) {
+        gcmd->header.header.status = -ENOMEM;
+        luxSendKernel(gcmd);
+        return;
+    }
+
+    memcpy(res, gcmd, sizeof(GetdentsCommand));
+    res->header.header.status = 0;
+    res->length = 0;
+    res->count = 0;
+    res->end = 0;
+
+    // positions 0 and 1 are '.' and '..', which are both the root here
+    size_t position = gcmd->position;
+    for(;;) {
+        if(position >= ROOT_FILES + 2) {
+            res->end = 1;
+            break;
+        }
+
+        const char *name;
+        if(position == 0) name = ".";
+        else if(position == 1) name = "..";
+        else name = rootFiles[position - 2];
+
+        size_t recordSize = (sizeof(DirentRecord) + strlen(name) + 1 + 7) & ~7;
+        if((res->length + recordSize) > capacity) {
+            // at least one record must fit
+            if(!res->count) res->header.header.status = -EINVAL;
+            break;
+        }
+
+        DirentRecord *record = (DirentRecord *)((uintptr_t)res->data + res->length);
+        record->length = recordSize;
+        record->position = ++position;
+        strcpy(record->name, name);
+
+        if(gcmd->flags & GETDENTS_STAT) {
+            char path[16];
+            path[0] = '/';
+            strcpy(path+1, name);
+
+            record->flags = GETDENTS_STAT;
+            if(position <= 2) procfsStatus(RESOLVE_DIRECTORY, &record->status);
+            else procfsStatus(resolve(path, &pid), &record->status);
+        }
+
+        res->length += recordSize;
+        res->count++;
+    }
+
+    res->position = position;
+    res->header.header.length += res->length;
+    luxSendKernel(res);
+    free(res);
+}
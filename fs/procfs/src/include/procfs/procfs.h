@@ -9,6 +9,7 @@
 
 #include <liblux/liblux.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 /* for /proc/kernel, /proc/memsize, /proc/memusage, etc */
 #define RESOLVE_KERNEL              1
@@ -41,5 +42,7 @@ void procfsStat(StatCommand *);
 void procfsOpen(OpenCommand *);
 void procfsRead(RWCommand *);
 void procfsWrite(RWCommand *);
+void procfsGetdents(GetdentsCommand *);
+void procfsStatus(int, struct stat *);
 
 int resolve(const char *, pid_t *);
@@ -40,6 +40,22 @@ void procfsOpen(OpenCommand *ocmd) {
     luxSendKernel(ocmd);
 }
 
+/* procfsStatus(): constructs the file status of a resolved file
+ * params: res - type of the resolved file
+ * params: buffer - destination stat structure
+ * returns: nothing
+ */
+
+void procfsStatus(int res, struct stat *buffer) {
+    memset(buffer, 0, sizeof(struct stat));
+    buffer->st_mode = S_IRUSR | S_IRGRP | S_IROTH;
+    if(res & RESOLVE_DIRECTORY) buffer->st_mode |= S_IFDIR;
+
+    if(res == RESOLVE_KERNEL) buffer->st_size = strlen(sysinfo->kernel);
+    else if(res == RESOLVE_CPU) buffer->st_size = strlen(sysinfo->cpu);
+    else buffer->st_size = 8;
+}
+
 void procfsStat(StatCommand *scmd) {
     scmd->header.header.response = 1;
     scmd->header.header.length = sizeof(StatCommand);
@@ -53,15 +69,7 @@ void procfsStat(StatCommand *scmd) {
     }
 
     scmd->header.header.status = 0;
-
-    memset(&scmd->buffer, 0, sizeof(struct stat));
-    scmd->buffer.st_mode = S_IRUSR | S_IRGRP | S_IROTH;
-    if(res & RESOLVE_DIRECTORY) scmd->buffer.st_mode |= S_IFDIR;
-
-    if(res == RESOLVE_KERNEL) scmd->buffer.st_size = strlen(sysinfo->kernel);
-    else if(res == RESOLVE_CPU) scmd->buffer.st_size = strlen(sysinfo->cpu);
-    else scmd->buffer.st_size = 8;
-
+    procfsStatus(res, &scmd->buffer);
     luxSendKernel(scmd);
 }
 
@@ -258,6 +258,54 @@ void vfsDispatchStatvfs(SyscallHeader *hdr) {
     }
 }
 
+void vfsDispatchGetdents(SyscallHeader *hdr) {
+    GetdentsCommand *cmd = (GetdentsCommand *) hdr;
+    char type[32];
+    if(resolve(cmd->path, type, cmd->device, cmd->path)) {
+        int sd = findFSServer(type);
+        if(sd <= 0) luxLogf(KPRINT_LEVEL_WARNING, "no file system driver loaded for '%s'\n", type);
+        else luxSend(sd, cmd);
+    } else {
+        luxLogf(KPRINT_LEVEL_WARNING, "could not resolve path '%s'\n", cmd->path);
+    }
+}
+
+void vfsDispatchFallocate(SyscallHeader *hdr) {
+    FallocateCommand *cmd = (FallocateCommand *) hdr;
+    char type[32];
+    if(resolve(cmd->path, type, cmd->device, cmd->path)) {
+        int sd = findFSServer(type);
+        if(sd <= 0) luxLogf(KPRINT_LEVEL_WARNING, "no file system driver loaded for '%s'\n", type);
+        else luxSend(sd, cmd);
+    } else {
+        luxLogf(KPRINT_LEVEL_WARNING, "could not resolve path '%s'\n", cmd->path);
+    }
+}
+
+void vfsDispatchCopyRange(SyscallHeader *hdr) {
+    CopyRangeCommand *cmd = (CopyRangeCommand *) hdr;
+    char type[32];
+    char device[MAX_FILE_PATH];
+    char *ptr = resolve(cmd->destPath, type, cmd->device, cmd->destPath);
+    if(ptr) ptr = resolve(cmd->srcPath, type, device, cmd->srcPath);
+    if(ptr) {
+        if(strcmp(cmd->device, device)) {
+            // copies between file systems are left to the caller, which can
+            // fall back to reading and writing
+            cmd->header.header.response = 1;
+            cmd->header.header.status = -EXDEV;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        int sd = findFSServer(type);
+        if(sd <= 0) luxLogf(KPRINT_LEVEL_WARNING, "no file system driver loaded for '%s'\n", type);
+        else luxSend(sd, cmd);
+    } else {
+        luxLogf(KPRINT_LEVEL_WARNING, "could not resolve paths '%s', '%s'\n", cmd->srcPath, cmd->destPath);
+    }
+}
+
 void (*vfsDispatchTable[])(SyscallHeader *) = {
     vfsDispatchStat,    // 0 - stat()
     vfsDispatchFsync,   // 1 - fsync()
@@ -282,5 +330,8 @@ void (*vfsDispatchTable[])(SyscallHeader *) = {
     vfsDispatchUnlink,  // 20 - unlink()
     vfsDispatchSymlink, // 21 - symlink()
     vfsDispatchReadLink,// 22 - readlink()
-    vfsDispatchStatvfs  // 23 - statvfs()
+    vfsDispatchStatvfs, // 23 - statvfs()
+    vfsDispatchGetdents,// 24 - getdents()
+    vfsDispatchFallocate,// 25 - fallocate()
+    vfsDispatchCopyRange,// 26 - copy_file_range()
 };
\ No newline at end of file
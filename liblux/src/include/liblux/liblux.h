@@ -61,8 +61,11 @@
 #define COMMAND_SYMLINK         0x8015
 #define COMMAND_READLINK        0x8016
 #define COMMAND_STATVFS         0x8017
+#define COMMAND_GETDENTS        0x8018  // batched readdir_r()
+#define COMMAND_FALLOCATE       0x8019
+#define COMMAND_COPY_RANGE      0x801A  // copy_file_range()
 
-#define MAX_SYSCALL_COMMAND     0x8017
+#define MAX_SYSCALL_COMMAND     0x801A
 
 /* these commands are for device drivers */
 #define COMMAND_IRQ             0xC000
@@ -131,6 +134,7 @@ typedef struct {
     char target[MAX_FILE_PATH];
     char type[32];
     int flags;
+    char options[256];      // file system specific, comma separated
 } MountCommand;
 
 /* umount() */
@@ -229,6 +233,31 @@ typedef struct {
     char data[MAX_FILE_PATH];
 } ReaddirCommand;
 
+/* getdents(), readdir_r() returning as many entries as fit in one message */
+#define GETDENTS_STAT           0x0001  // also return file status of each entry
+
+typedef struct {
+    uint16_t length;        // total length of this record, multiple of 8 bytes
+    uint16_t flags;         // GETDENTS_STAT if status is valid
+    uint32_t reserved;
+    uint64_t position;      // position of the entry after this one
+    ino_t inode;
+    struct stat status;     // zero unless requested
+    char name[];            // null terminated
+} DirentRecord;
+
+typedef struct {
+    SyscallHeader header;
+    char path[MAX_FILE_PATH];
+    char device[MAX_FILE_PATH];
+    int flags;          // GETDENTS_STAT
+    size_t position;    // same as readdir_r(), updated past the last record
+    size_t length;      // size of the data buffer, then bytes used in response
+    size_t count;       // number of records returned
+    int end;            // set to 1 if the last record ends the directory
+    uint64_t data[];    // packed DirentRecord structures
+} GetdentsCommand;
+
 /* chmod() */
 typedef struct {
     SyscallHeader header;
@@ -369,6 +398,36 @@ typedef struct {
     struct statvfs buffer;
 } StatvfsCommand;
 
+/* fallocate() */
+#define FALLOCATE_KEEP_SIZE     0x0001  // reserve space without growing the file
+
+typedef struct {
+    SyscallHeader header;
+    char path[MAX_FILE_PATH];
+    char device[MAX_FILE_PATH];
+    uint64_t id;
+    uid_t uid;
+    gid_t gid;
+    int mode;           // FALLOCATE_KEEP_SIZE
+    off_t offset;
+    off_t length;
+} FallocateCommand;
+
+/* copy_file_range() within a single file system */
+typedef struct {
+    SyscallHeader header;
+    char srcPath[MAX_FILE_PATH];
+    char destPath[MAX_FILE_PATH];
+    char device[MAX_FILE_PATH];
+    uint64_t srcId;
+    uint64_t destId;
+    uid_t uid;
+    gid_t gid;
+    off_t srcPosition;      // both positions are updated past the bytes copied
+    off_t destPosition;
+    size_t length;          // status is the number of bytes copied
+} CopyRangeCommand;
+
 /* wrapper functions */
 pid_t luxGetSelf();
 const char *luxGetName();